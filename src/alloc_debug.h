@@ -0,0 +1,26 @@
+//
+//  alloc_debug.h
+//  tbce
+//
+//  Created by George Watson on 17/10/2026.
+//
+
+#ifndef alloc_debug_h
+#define alloc_debug_h
+#include "common.h"
+
+// Debug builds count every malloc, calloc and realloc in the sources that
+// include this, per thread. Only first-party .c files include it, and only
+// after everything else, so vendored headers keep their own allocator.
+#if !defined(NDEBUG)
+void* CountedMalloc(size_t size);
+void* CountedCalloc(size_t count, size_t size);
+void* CountedRealloc(void *buffer, size_t size);
+// Allocations made by the calling thread since it started
+size_t HeapAllocations(void);
+#define malloc(size) CountedMalloc(size)
+#define calloc(count, size) CountedCalloc(count, size)
+#define realloc(buffer, size) CountedRealloc(buffer, size)
+#endif
+
+#endif /* alloc_debug_h */
@@ -0,0 +1,329 @@
+//
+//  bench.c
+//  tbce
+//
+//  Created by George Watson on 17/10/2026.
+//
+
+#include "bench.h"
+#include "map.h"
+#include "sim.h"
+#include "model.h"
+#include <time.h>
+#define FAST_OBJ_IMPLEMENTATION
+#include "fast_obj.h"
+
+static double Now(void) {
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+// One in five tiles is a wall so both floors and walls are represented
+static void FillBenchMap(Map *map, int size) {
+    for (int y = 0; y < size; y++)
+        for (int x = 0; x < size; x++)
+            if ((x + y * 3) % 5 == 0) {
+                Tile tile = *GetTile(map, x, y);
+                tile.solid = 1;
+                SetTile(map, x, y, tile);
+            }
+}
+
+// Frame time of RenderMap against map size, rendered into a hidden window
+static void BenchMapSizes(Texture *spritesheet, int maxSize) {
+    static const int sizes[] = { 64, 128, 256, 512, 1024, 2048, 4096 };
+    const int vw = 640, vh = 480, frames = 30;
+    printf("%-8s %12s %12s %12s\n", "map", "tiles", "cpu ms", "gpu ms");
+    for (int i = 0; i < sizeof(sizes) / sizeof(int) && sizes[i] <= maxSize; i++) {
+        int size = sizes[i];
+        Map map;
+        InitMap(&map, spritesheet, size, size);
+        FillBenchMap(&map, size);
+        Camera camera = {
+            .position = Vec3New(size * .5f, size * .5f, 0.f),
+            .angle = PI * .25f,
+            .pitch = PI + HALF_PI + .5f,
+            .zoom = 64.f
+        };
+        double ms[2];
+        for (int mode = 0; mode < 2; mode++) {
+            map.mode = mode ? MAP_RENDER_GPU : MAP_RENDER_CPU;
+            // First frame builds resident geometry, keep it out of the timing
+            RenderMap(&map, vw, vh, &camera, (Vec2i){ -1, -1 });
+            glFinish();
+            double start = glfwGetTime();
+            for (int frame = 0; frame < frames; frame++) {
+                ResetFrameArena();
+                glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+                camera.angle += .01f;
+                RenderMap(&map, vw, vh, &camera, (Vec2i){ -1, -1 });
+            }
+            glFinish();
+            ms[mode] = (glfwGetTime() - start) * 1000.0 / frames;
+        }
+        printf("%-8d %12lld %12.3f %12.3f\n", size, (long long)size * size, ms[0], ms[1]);
+        DestroyMap(&map);
+    }
+}
+
+// Frame time of the CPU path against job threads, zoomed out until the
+// whole map is in view so every tile goes through face generation
+static void BenchMapThreads(Texture *spritesheet, int size) {
+    static const int threads[] = { 1, 2, 4, 8, 16 };
+    const int vw = 640, vh = 480, frames = 20;
+    Map map;
+    InitMap(&map, spritesheet, size, size);
+    FillBenchMap(&map, size);
+    Camera camera = {
+        .position = Vec3New(size * .5f, size * .5f, 0.f),
+        .angle = PI * .25f,
+        .pitch = PI + HALF_PI + .5f,
+        .zoom = (float)vh / ((float)size * 1.5f)
+    };
+    printf("%-8s %12s %12s  (%d cores)\n", "threads", "cpu ms", "speedup", CPUCount());
+    double base = 0.0;
+    for (int i = 0; i < sizeof(threads) / sizeof(int); i++) {
+        DestroyJobSystem();
+        InitJobSystem(threads[i]);
+        RenderMap(&map, vw, vh, &camera, (Vec2i){ -1, -1 });
+        glFinish();
+        double start = glfwGetTime();
+        for (int frame = 0; frame < frames; frame++) {
+            ResetFrameArena();
+            glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+            camera.angle += .01f;
+            RenderMap(&map, vw, vh, &camera, (Vec2i){ -1, -1 });
+        }
+        glFinish();
+        double ms = (glfwGetTime() - start) * 1000.0 / frames;
+        if (!i)
+            base = ms;
+        printf("%-8d %12.3f %11.2fx\n", threads[i], ms, base / ms);
+    }
+    DestroyMap(&map);
+}
+
+static void EmptyJob(void *arg, int index) {
+}
+
+// Stands in for the smallest useful job, a few flops on its own slot
+static void TinyJob(void *arg, int index) {
+    float *values = arg;
+    values[index] = values[index] * 1.0001f + 1.f;
+}
+
+// Kept under the scheduler's limit of parked jobs
+#define BENCH_CHAIN 128
+#define BENCH_BATCH 512
+
+static void ChainJob(void *arg, int index) {
+}
+
+// Cost per job of the scheduler itself, then tiny-job throughput against
+// thread count. No window or GL context involved.
+static void BenchJobs(int count) {
+    static const int threads[] = { 1, 2, 4, 8, 16 };
+    printf("%-8s %12s %12s %12s %12s %12s  (%d cores)\n", "threads", "spawn ns", "steal ns", "chain ns", "tiny Mjobs/s", "speedup", CPUCount());
+    float *values = calloc(count, sizeof(float));
+    assert(values);
+    JobCounter counters[BENCH_CHAIN];
+    int batches = MAX(1, count / BENCH_BATCH);
+    double base = 0.0;
+    for (int i = 0; i < sizeof(threads) / sizeof(int); i++) {
+        InitJobSystem(threads[i]);
+        // Spawn and run from one thread, mostly push and pop. Batches stay
+        // under the deque size so nothing falls back to running inline.
+        double start = Now();
+        for (int batch = 0; batch < batches; batch++) {
+            JobCounter counter = {0};
+            for (int j = 0; j < BENCH_BATCH; j++)
+                RunJob(EmptyJob, NULL, j, &counter);
+            WaitForCounter(&counter);
+        }
+        double spawn = (Now() - start) * 1e9 / ((double)batches * BENCH_BATCH);
+        
+        // Same again but the spawning thread never helps, every job is stolen
+        double steal = 0.0;
+        if (threads[i] > 1) {
+            start = Now();
+            for (int batch = 0; batch < batches; batch++) {
+                JobCounter counter = {0};
+                for (int j = 0; j < BENCH_BATCH; j++)
+                    RunJob(EmptyJob, NULL, j, &counter);
+                while (atomic_load(&counter.value))
+                    ;
+            }
+            steal = (Now() - start) * 1e9 / ((double)batches * BENCH_BATCH);
+        }
+        
+        // Each job waits on the one before it, so this is the latency of
+        // handing a dependency on
+        start = Now();
+        for (int j = 0; j < BENCH_CHAIN; j++)
+            atomic_init(&counters[j].value, 0);
+        for (int j = 0; j < BENCH_CHAIN; j++)
+            RunJobAfter(j ? &counters[j - 1] : NULL, ChainJob, NULL, j, &counters[j]);
+        WaitForCounter(&counters[BENCH_CHAIN - 1]);
+        double chain = (Now() - start) * 1e9 / BENCH_CHAIN;
+        
+        start = Now();
+        ParallelFor(TinyJob, values, count);
+        double tiny = Now() - start;
+        if (!i)
+            base = tiny;
+        printf("%-8d %12.1f %12.1f %12.1f %12.2f %11.2fx\n", threads[i], spawn, steal, chain, count / tiny * 1e-6, base / tiny);
+        DestroyJobSystem();
+    }
+    // Keeps the tiny jobs from being optimised away
+    printf("checksum: %f\n", values[count / 2]);
+    free(values);
+}
+
+// Fixed steps of the simulation alone, no window or GL context involved. The
+// camera target jumps every second of simulated time so it never settles.
+static void BenchSimulation(long steps) {
+    Camera camera = {
+        .position = Vec3Zero(),
+        .angle = 0.f,
+        .pitch = PI + HALF_PI,
+        .zoom = 64.f
+    };
+    Camera target = camera;
+    Simulation sim;
+    InitSimulation(&sim, &camera);
+    double start = Now();
+    for (long i = 0; i < steps; i++) {
+        if (i % 60 == 0) {
+            target.position = Vec3New((float)(i % 97), (float)(i % 89), 0.f);
+            target.angle = (float)(i % 360) * (PI / 180.f);
+            target.zoom = 16.f + (float)(i % 128);
+        }
+        AdvanceSimulation(&sim, &target, SIM_TIMESTEP);
+    }
+    double elapsed = Now() - start;
+    Camera out;
+    InterpolateSimulation(&sim, &out);
+    printf("%-12s %12s %12s\n", "steps", "total ms", "ns/step");
+    printf("%-12ld %12.3f %12.3f\n", steps, elapsed * 1000.0, elapsed * 1e9 / (double)steps);
+    // Keeps the loop from being optimised away
+    printf("final camera: %f, %f %f\n", out.position.x, out.position.y, out.zoom);
+}
+
+// A square grid of quads with every attribute, written a row at a time so
+// odd rows can point back at their vertices with negative indices
+static int WriteBenchObj(const char *path, long faces) {
+    FILE *file = fopen(path, "w");
+    if (!file)
+        return 0;
+    int side = (int)ceil(sqrt((double)faces)) + 1;
+    for (int y = 0; y < side; y++) {
+        for (int x = 0; x < side; x++) {
+            fprintf(file, "v %f %f %f\n", x * .01f, y * .01f, sinf(x * .1f) * cosf(y * .1f));
+            fprintf(file, "vt %f %f\n", (float)x / side, (float)y / side);
+            fprintf(file, "vn 0 0 1\n");
+        }
+        if (!y)
+            continue;
+        for (int x = 0; x < side - 1; x++) {
+            int a = y % 2 ? x - side : y * side + x + 1;
+            int b = a + 1, c = a - side, d = c + 1;
+            fprintf(file, "f %d/%d/%d %d/%d/%d %d/%d/%d %d/%d/%d\n", c, c, c, d, d, d, b, b, b, a, a, a);
+        }
+    }
+    fclose(file);
+    return 1;
+}
+
+// The serial fast_obj reader against ParseObj at each thread count, on a
+// synthetic file big enough to hide the scheduler's own cost
+static void BenchObj(long faces) {
+    static const int threads[] = { 1, 2, 4, 8, 16 };
+    const char *path = "bench.obj";
+    printf("writing %ld faces to %s\n", faces, path);
+    if (!WriteBenchObj(path, faces)) {
+        printf("BENCH ERROR: failed to write %s\n", path);
+        return;
+    }
+    double start = Now();
+    fastObjMesh *reference = fast_obj_read(path);
+    double serial = Now() - start;
+    if (!reference) {
+        printf("BENCH ERROR: fast_obj failed to read %s\n", path);
+        remove(path);
+        return;
+    }
+    printf("%-10s %12s %12s  (%d cores)\n", "threads", "parse ms", "speedup", CPUCount());
+    printf("%-10s %12.3f %11.2fx\n", "fast_obj", serial * 1000.0, 1.0);
+    for (int i = 0; i < sizeof(threads) / sizeof(int); i++) {
+        InitJobSystem(threads[i]);
+        ObjData data;
+        start = Now();
+        int loaded = ParseObj(path, &data);
+        double ms = (Now() - start) * 1000.0;
+        DestroyJobSystem();
+        if (!loaded) {
+            printf("BENCH ERROR: failed to parse %s\n", path);
+            break;
+        }
+        printf("%-10d %12.3f %11.2fx\n", threads[i], ms, serial * 1000.0 / ms);
+        // Both have to agree before the timings mean anything, checked
+        // without assert so release builds still do it
+        if (data.sizeOfPositions != reference->position_count ||
+            data.sizeOfTexcoords != reference->texcoord_count ||
+            data.sizeOfNormals != reference->normal_count ||
+            data.sizeOfFaces != reference->face_count ||
+            data.sizeOfIndices != reference->index_count) {
+            printf("BENCH ERROR: counts differ from fast_obj\n");
+            FreeObjData(&data);
+            break;
+        }
+        for (uint32_t j = 0; j < data.sizeOfIndices; j++)
+            if (data.indices[j].p != reference->indices[j].p ||
+                data.indices[j].t != reference->indices[j].t ||
+                data.indices[j].n != reference->indices[j].n) {
+                printf("BENCH ERROR: index %u differs from fast_obj\n", j);
+                break;
+            }
+        FreeObjData(&data);
+    }
+    fast_obj_destroy(reference);
+    remove(path);
+}
+
+int RunBenchmarks(int argc, const char *argv[]) {
+    if (argc > 2 && !strcmp(argv[2], "sim")) {
+        BenchSimulation(argc > 3 ? atol(argv[3]) : 10000000);
+        return 0;
+    }
+    if (argc > 2 && !strcmp(argv[2], "jobs")) {
+        BenchJobs(argc > 3 ? atoi(argv[3]) : 1 << 20);
+        return 0;
+    }
+    if (argc > 2 && !strcmp(argv[2], "obj")) {
+        BenchObj(argc > 3 ? atol(argv[3]) : 10000000);
+        return 0;
+    }
+    int threads = argc > 2 && !strcmp(argv[2], "threads");
+    int maxSize = argc > 2 + threads ? atoi(argv[2 + threads]) : threads ? 1024 : 4096;
+    if (!glfwInit())
+        return 1;
+    glfwWindowHint(GLFW_VISIBLE, GLFW_FALSE);
+    GLFWwindow *window = glfwCreateWindow(640, 480, "tbce", NULL, NULL);
+    if (!window)
+        return 1;
+    glfwMakeContextCurrent(window);
+    if (InitOpenGL())
+        return 1;
+    glfwSwapInterval(0);
+    InitJobSystem(0);
+    Texture spritesheet = LoadTexture("assets/5z1KX.png");
+    if (threads)
+        BenchMapThreads(&spritesheet, maxSize);
+    else
+        BenchMapSizes(&spritesheet, maxSize);
+    DestroyJobSystem();
+    glfwDestroyWindow(window);
+    glfwTerminate();
+    return 0;
+}
@@ -0,0 +1,14 @@
+//
+//  bench.h
+//  tbce
+//
+//  Created by George Watson on 17/10/2026.
+//
+
+#ifndef bench_h
+#define bench_h
+#include "common.h"
+
+int RunBenchmarks(int argc, const char *argv[]);
+
+#endif /* bench_h */
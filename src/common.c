@@ -6,14 +6,51 @@
 //
 
 #include "common.h"
+#if defined(PLATFORM_WINDOWS)
+#include <windows.h>
+#else
+#include <unistd.h>
+#include <sched.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+#include "alloc_debug.h"
 
 Texture LoadTexture(const char *path) {
-    ezImage *image = ezImageLoadFromPath(path);
-    Texture result = LoadTextureFromMemory(image);
-    ezImageFree(image);
+    Texture result;
+    LoadTextures(&path, &result, 1);
     return result;
 }
 
+typedef struct {
+    const char **paths;
+    ezImage **images;
+} TextureJobs;
+
+static void DecodeTextureJob(void *arg, int index) {
+    TextureJobs *jobs = arg;
+    jobs->images[index] = ezImageLoadFromPath(jobs->paths[index]);
+}
+
+void LoadTextures(const char **paths, Texture *out, int count) {
+    ezImage *images[count];
+    TextureJobs jobs = {
+        .paths = paths,
+        .images = images
+    };
+    ParallelFor(DecodeTextureJob, &jobs, count);
+    // GL calls have to stay on the thread that owns the context
+    for (int i = 0; i < count; i++) {
+        if (!images[i]) {
+            printf("ERROR: failed to load \"%s\"\n", paths[i]);
+            abort();
+        }
+        out[i] = LoadTextureFromMemory(images[i]);
+        ezImageFree(images[i]);
+    }
+}
+
 Texture LoadTextureFromMemory(ezImage *image) {
     GLuint id = -1;
     glGenTextures(1, &id);
@@ -29,9 +66,605 @@ Texture LoadTextureFromMemory(ezImage *image) {
     };
 }
 
+#define FRAME_ARENA_SIZE (1 << 20)
+#define FRAME_ARENA_ALIGN 16
+
+static struct {
+    uint8_t *data;
+    size_t size, capacity;
+    void **spills; // whatever didn't fit this frame, freed on reset
+    size_t sizeOfSpills, capacityOfSpills;
+    size_t spilled;
+} arena;
+
+#if !defined(NDEBUG)
+static _Thread_local size_t heapAllocations;
+
+// The parentheses keep these from expanding back into themselves
+void* CountedMalloc(size_t size) {
+    heapAllocations++;
+    return (malloc)(size);
+}
+
+void* CountedCalloc(size_t count, size_t size) {
+    heapAllocations++;
+    return (calloc)(count, size);
+}
+
+void* CountedRealloc(void *buffer, size_t size) {
+    heapAllocations++;
+    return (realloc)(buffer, size);
+}
+
+size_t HeapAllocations(void) {
+    return heapAllocations;
+}
+#endif
+
+void* GrowBuffer(void *buffer, size_t *capacity, size_t count, size_t size) {
+    if (count <= *capacity)
+        return buffer;
+    size_t grown = *capacity ? *capacity : 1024;
+    while (grown < count)
+        grown *= 2;
+    *capacity = grown;
+    buffer = realloc(buffer, grown * size);
+    assert(buffer);
+    return buffer;
+}
+
+void* FrameAlloc(size_t size) {
+    size = (size + FRAME_ARENA_ALIGN - 1) & ~(size_t)(FRAME_ARENA_ALIGN - 1);
+    if (arena.size + size <= arena.capacity) {
+        void *result = arena.data + arena.size;
+        arena.size += size;
+        return result;
+    }
+    arena.spills = GrowBuffer(arena.spills, &arena.capacityOfSpills, arena.sizeOfSpills + 1, sizeof(void*));
+    void *result = malloc(size);
+    assert(result);
+    arena.spills[arena.sizeOfSpills++] = result;
+    arena.spilled += size;
+    return result;
+}
+
+void ResetFrameArena(void) {
+    for (size_t i = 0; i < arena.sizeOfSpills; i++)
+        free(arena.spills[i]);
+    if (arena.spilled || !arena.data) {
+        // Room for everything the last frame needed in one block
+        size_t capacity = arena.capacity ? arena.capacity : FRAME_ARENA_SIZE;
+        while (capacity < arena.size + arena.spilled)
+            capacity *= 2;
+        if (arena.data)
+            free(arena.data);
+        arena.data = malloc(capacity);
+        assert(arena.data);
+        arena.capacity = capacity;
+    }
+    arena.size = 0;
+    arena.sizeOfSpills = 0;
+    arena.spilled = 0;
+}
+
 void PushColor(Color color) {
     glColor4f(TO_FLOAT(color.r),
               TO_FLOAT(color.g),
               TO_FLOAT(color.b),
               TO_FLOAT(color.a));
 }
+
+void* MapFile(const char *path, size_t *size) {
+#if defined(PLATFORM_WINDOWS)
+    HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE)
+        return NULL;
+    LARGE_INTEGER length;
+    void *result = NULL;
+    if (GetFileSizeEx(file, &length) && length.QuadPart > 0) {
+        HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+        if (mapping) {
+            // The view keeps the file alive once both handles are closed
+            result = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+            CloseHandle(mapping);
+        }
+    }
+    CloseHandle(file);
+    if (result)
+        *size = (size_t)length.QuadPart;
+    return result;
+#else
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+    struct stat info;
+    void *result = NULL;
+    if (!fstat(fd, &info) && info.st_size > 0) {
+        result = mmap(NULL, (size_t)info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (result == MAP_FAILED)
+            result = NULL;
+    }
+    close(fd);
+    if (result)
+        *size = (size_t)info.st_size;
+    return result;
+#endif
+}
+
+void UnmapFile(void *data, size_t size) {
+    if (!data)
+        return;
+#if defined(PLATFORM_WINDOWS)
+    UnmapViewOfFile(data);
+#else
+    munmap(data, size);
+#endif
+}
+
+int RenameFile(const char *from, const char *to) {
+#if defined(PLATFORM_WINDOWS)
+    return MoveFileExA(from, to, MOVEFILE_REPLACE_EXISTING) != 0;
+#else
+    return !rename(from, to);
+#endif
+}
+
+static GLuint CompileShader(GLenum type, const char *source) {
+    GLuint shader = glCreateShader(type);
+    glShaderSource(shader, 1, &source, NULL);
+    glCompileShader(shader);
+    GLint status = GL_FALSE;
+    glGetShaderiv(shader, GL_COMPILE_STATUS, &status);
+    if (status != GL_TRUE) {
+        char log[1024];
+        glGetShaderInfoLog(shader, sizeof(log), NULL, log);
+        printf("SHADER ERROR: %s\n", log);
+        glDeleteShader(shader);
+        return 0;
+    }
+    return shader;
+}
+
+GLuint LoadShader(const char *vertex, const char *fragment) {
+    GLuint vs = CompileShader(GL_VERTEX_SHADER, vertex);
+    GLuint fs = CompileShader(GL_FRAGMENT_SHADER, fragment);
+    if (!vs || !fs) {
+        if (vs)
+            glDeleteShader(vs);
+        if (fs)
+            glDeleteShader(fs);
+        return 0;
+    }
+    GLuint program = glCreateProgram();
+    glAttachShader(program, vs);
+    glAttachShader(program, fs);
+    glLinkProgram(program);
+    glDeleteShader(vs);
+    glDeleteShader(fs);
+    GLint status = GL_FALSE;
+    glGetProgramiv(program, GL_LINK_STATUS, &status);
+    if (status != GL_TRUE) {
+        char log[1024];
+        glGetProgramInfoLog(program, sizeof(log), NULL, log);
+        printf("SHADER ERROR: %s\n", log);
+        glDeleteProgram(program);
+        return 0;
+    }
+    return program;
+}
+
+void InitTripleBuffer(TripleBuffer *buffer, size_t sizeOfSlot) {
+    buffer->data = calloc(3, sizeOfSlot);
+    assert(buffer->data);
+    buffer->sizeOfSlot = sizeOfSlot;
+    buffer->back = 0;
+    atomic_init(&buffer->middle, 1);
+    buffer->front = 2;
+}
+
+void DestroyTripleBuffer(TripleBuffer *buffer) {
+    if (buffer->data)
+        free(buffer->data);
+    buffer->data = NULL;
+}
+
+void* TripleBufferBack(TripleBuffer *buffer) {
+    return buffer->data + buffer->back * buffer->sizeOfSlot;
+}
+
+// Returns 1 when the slot given back held a write the reader never took, it
+// becomes the new back slot so the writer can carry anything over from it
+int TripleBufferPublish(TripleBuffer *buffer) {
+    int old = atomic_exchange_explicit(&buffer->middle, buffer->back | TRIPLE_BUFFER_FRESH, memory_order_acq_rel);
+    buffer->back = old & ~TRIPLE_BUFFER_FRESH;
+    return !!(old & TRIPLE_BUFFER_FRESH);
+}
+
+int TripleBufferFresh(TripleBuffer *buffer) {
+    return !!(atomic_load_explicit(&buffer->middle, memory_order_acquire) & TRIPLE_BUFFER_FRESH);
+}
+
+// Swaps in the newest write if there is one, either way returns the reader's slot
+void* TripleBufferAcquire(TripleBuffer *buffer) {
+    if (TripleBufferFresh(buffer))
+        buffer->front = atomic_exchange_explicit(&buffer->middle, buffer->front, memory_order_acq_rel) & ~TRIPLE_BUFFER_FRESH;
+    return buffer->data + buffer->front * buffer->sizeOfSlot;
+}
+
+void InitRingBuffer(RingBuffer *buffer, size_t sizeOfItem, size_t capacity) {
+    size_t size = 1;
+    while (size < capacity)
+        size <<= 1;
+    buffer->data = malloc(sizeOfItem * size);
+    assert(buffer->data);
+    buffer->sizeOfItem = sizeOfItem;
+    buffer->capacity = size;
+    atomic_init(&buffer->head, 0);
+    atomic_init(&buffer->tail, 0);
+}
+
+void DestroyRingBuffer(RingBuffer *buffer) {
+    if (buffer->data)
+        free(buffer->data);
+    buffer->data = NULL;
+}
+
+int RingBufferPush(RingBuffer *buffer, const void *item) {
+    size_t tail = atomic_load_explicit(&buffer->tail, memory_order_relaxed);
+    if (tail - atomic_load_explicit(&buffer->head, memory_order_acquire) == buffer->capacity)
+        return 0;
+    memcpy(buffer->data + (tail & (buffer->capacity - 1)) * buffer->sizeOfItem, item, buffer->sizeOfItem);
+    atomic_store_explicit(&buffer->tail, tail + 1, memory_order_release);
+    return 1;
+}
+
+int RingBufferPop(RingBuffer *buffer, void *out) {
+    size_t head = atomic_load_explicit(&buffer->head, memory_order_relaxed);
+    if (head == atomic_load_explicit(&buffer->tail, memory_order_acquire))
+        return 0;
+    memcpy(out, buffer->data + (head & (buffer->capacity - 1)) * buffer->sizeOfItem, buffer->sizeOfItem);
+    atomic_store_explicit(&buffer->head, head + 1, memory_order_release);
+    return 1;
+}
+
+int CPUCount(void) {
+#if defined(PLATFORM_WINDOWS)
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return (int)info.dwNumberOfProcessors;
+#else
+    long count = sysconf(_SC_NPROCESSORS_ONLN);
+    return count > 0 ? (int)count : 1;
+#endif
+}
+
+#define JOB_QUEUE_SIZE 1024 // power of two
+#define JOB_MAX_DEFERRED 256
+// Deques kept for threads registered after start, e.g. the render thread
+#define JOB_EXTRA_THREADS 4
+// Times an idle worker looks for work again before going to sleep
+#define JOB_SPIN_COUNT 64
+
+typedef struct {
+    JobFunc func;
+    void *arg;
+    int index;
+    JobCounter *signal;
+    JobCounter *dependency;
+} Job;
+
+// Chase-Lev deque. The owner pushes and pops at the bottom without any
+// contention unless a single job is left, thieves race each other for the
+// top with a compare and swap.
+typedef struct {
+    atomic_llong top;
+    char padTop[64];
+    atomic_llong bottom;
+    char padBottom[64];
+    Job jobs[JOB_QUEUE_SIZE];
+} JobQueue;
+
+static struct {
+    JobQueue *queues;
+    int capacityOfQueues;
+    atomic_int sizeOfQueues;
+    pthread_t *threads;
+    int sizeOfThreads;
+    atomic_int pending; // pushed and not taken yet
+    atomic_int sleeping;
+    atomic_int quit;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    // Jobs waiting on a dependency, parked until its counter reaches zero
+    pthread_mutex_t deferredLock;
+    Job deferred[JOB_MAX_DEFERRED];
+    atomic_int sizeOfDeferred;
+} jobs;
+
+static _Thread_local int jobQueue = -1;
+static _Thread_local unsigned int jobSeed;
+
+static void YieldThread(void) {
+#if defined(PLATFORM_WINDOWS)
+    SwitchToThread();
+#else
+    sched_yield();
+#endif
+}
+
+static int PushJob(JobQueue *queue, const Job *job) {
+    long long b = atomic_load_explicit(&queue->bottom, memory_order_relaxed);
+    long long t = atomic_load_explicit(&queue->top, memory_order_acquire);
+    if (b - t >= JOB_QUEUE_SIZE)
+        return 0;
+    queue->jobs[b & (JOB_QUEUE_SIZE - 1)] = *job;
+    atomic_thread_fence(memory_order_release);
+    atomic_store_explicit(&queue->bottom, b + 1, memory_order_relaxed);
+    return 1;
+}
+
+static int PopJob(JobQueue *queue, Job *out) {
+    long long b = atomic_load_explicit(&queue->bottom, memory_order_relaxed) - 1;
+    atomic_store_explicit(&queue->bottom, b, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    long long t = atomic_load_explicit(&queue->top, memory_order_relaxed);
+    if (t > b) {
+        atomic_store_explicit(&queue->bottom, b + 1, memory_order_relaxed);
+        return 0;
+    }
+    *out = queue->jobs[b & (JOB_QUEUE_SIZE - 1)];
+    if (t < b)
+        return 1;
+    // Last one left, a thief may be going for it too
+    int won = atomic_compare_exchange_strong_explicit(&queue->top, &t, t + 1, memory_order_seq_cst, memory_order_relaxed);
+    atomic_store_explicit(&queue->bottom, b + 1, memory_order_relaxed);
+    return won;
+}
+
+static int StealJob(JobQueue *queue, Job *out) {
+    long long t = atomic_load_explicit(&queue->top, memory_order_acquire);
+    atomic_thread_fence(memory_order_seq_cst);
+    long long b = atomic_load_explicit(&queue->bottom, memory_order_acquire);
+    if (t >= b)
+        return 0;
+    // Copied before the claim. The slot is only reused once top has moved
+    // past it, and then the claim fails and the copy is thrown away.
+    *out = queue->jobs[t & (JOB_QUEUE_SIZE - 1)];
+    return atomic_compare_exchange_strong_explicit(&queue->top, &t, t + 1, memory_order_seq_cst, memory_order_relaxed);
+}
+
+static int TakeJob(Job *out) {
+    if (jobQueue >= 0 && PopJob(&jobs.queues[jobQueue], out))
+        return 1;
+    int n = MIN(atomic_load_explicit(&jobs.sizeOfQueues, memory_order_acquire), jobs.capacityOfQueues);
+    // Start somewhere different every time so thieves spread out
+    jobSeed = jobSeed * 1103515245u + 12345u;
+    int start = (int)((jobSeed >> 16) % (unsigned int)n);
+    for (int i = 0; i < n; i++) {
+        int victim = (start + i) % n;
+        if (victim != jobQueue && StealJob(&jobs.queues[victim], out))
+            return 1;
+    }
+    return 0;
+}
+
+static void SubmitJob(Job *job);
+
+static void ReleaseDeferred(void) {
+    Job ready[JOB_MAX_DEFERRED];
+    int sizeOfReady = 0;
+    pthread_mutex_lock(&jobs.deferredLock);
+    int n = atomic_load(&jobs.sizeOfDeferred);
+    for (int i = 0; i < n;)
+        if (atomic_load(&jobs.deferred[i].dependency->value) <= 0) {
+            ready[sizeOfReady++] = jobs.deferred[i];
+            jobs.deferred[i] = jobs.deferred[--n];
+        } else
+            i++;
+    atomic_store(&jobs.sizeOfDeferred, n);
+    pthread_mutex_unlock(&jobs.deferredLock);
+    for (int i = 0; i < sizeOfReady; i++)
+        SubmitJob(&ready[i]);
+}
+
+static void FinishJob(Job *job) {
+    job->func(job->arg, job->index);
+    // Whoever takes a counter to zero hands out the jobs waiting on it
+    if (job->signal && atomic_fetch_sub(&job->signal->value, 1) == 1 && atomic_load(&jobs.sizeOfDeferred))
+        ReleaseDeferred();
+}
+
+static void SubmitJob(Job *job) {
+    if (jobQueue < 0) {
+        FinishJob(job);
+        return;
+    }
+    atomic_fetch_add(&jobs.pending, 1);
+    if (!PushJob(&jobs.queues[jobQueue], job)) {
+        // Full, nowhere to put it but here
+        atomic_fetch_sub(&jobs.pending, 1);
+        FinishJob(job);
+        return;
+    }
+    if (atomic_load(&jobs.sleeping)) {
+        pthread_mutex_lock(&jobs.lock);
+        pthread_cond_signal(&jobs.wake);
+        pthread_mutex_unlock(&jobs.lock);
+    }
+}
+
+static int RunNextJob(void) {
+    Job job;
+    if (!TakeJob(&job))
+        return 0;
+    atomic_fetch_sub(&jobs.pending, 1);
+    FinishJob(&job);
+    return 1;
+}
+
+static void* JobWorker(void *arg) {
+    jobQueue = (int)(intptr_t)arg;
+    jobSeed = (unsigned int)jobQueue * 2654435761u;
+    int idle = 0;
+    while (!atomic_load(&jobs.quit)) {
+        if (RunNextJob()) {
+            idle = 0;
+            continue;
+        }
+        // Jobs tend to come in bursts, look again a few times before sleeping
+        if (++idle < JOB_SPIN_COUNT) {
+            YieldThread();
+            continue;
+        }
+        idle = 0;
+        // Either this sees the push or the pusher sees this sleeping
+        pthread_mutex_lock(&jobs.lock);
+        atomic_fetch_add(&jobs.sleeping, 1);
+        while (!atomic_load(&jobs.pending) && !atomic_load(&jobs.quit))
+            pthread_cond_wait(&jobs.wake, &jobs.lock);
+        atomic_fetch_sub(&jobs.sleeping, 1);
+        pthread_mutex_unlock(&jobs.lock);
+    }
+    return NULL;
+}
+
+void InitJobSystem(int threads) {
+    if (threads <= 0)
+        threads = CPUCount();
+    jobs.capacityOfQueues = threads + JOB_EXTRA_THREADS;
+    jobs.queues = calloc(jobs.capacityOfQueues, sizeof(JobQueue));
+    assert(jobs.queues);
+    jobs.threads = threads > 1 ? malloc(sizeof(pthread_t) * (threads - 1)) : NULL;
+    jobs.sizeOfThreads = 0;
+    atomic_init(&jobs.sizeOfQueues, threads);
+    atomic_init(&jobs.pending, 0);
+    atomic_init(&jobs.sleeping, 0);
+    atomic_init(&jobs.quit, 0);
+    atomic_init(&jobs.sizeOfDeferred, 0);
+    pthread_mutex_init(&jobs.lock, NULL);
+    pthread_cond_init(&jobs.wake, NULL);
+    pthread_mutex_init(&jobs.deferredLock, NULL);
+    // The caller is always queue 0, workers take the ones after it
+    jobQueue = 0;
+    jobSeed = 1;
+    for (int i = 1; i < threads; i++)
+        if (!pthread_create(&jobs.threads[jobs.sizeOfThreads], NULL, JobWorker, (void*)(intptr_t)i))
+            jobs.sizeOfThreads++;
+}
+
+// Every other thread has to be done with jobs by now
+void DestroyJobSystem(void) {
+    if (!jobs.queues)
+        return;
+    pthread_mutex_lock(&jobs.lock);
+    atomic_store(&jobs.quit, 1);
+    pthread_cond_broadcast(&jobs.wake);
+    pthread_mutex_unlock(&jobs.lock);
+    for (int i = 0; i < jobs.sizeOfThreads; i++)
+        pthread_join(jobs.threads[i], NULL);
+    if (jobs.threads)
+        free(jobs.threads);
+    free(jobs.queues);
+    jobs.queues = NULL;
+    jobs.threads = NULL;
+    jobs.sizeOfThreads = 0;
+    pthread_mutex_destroy(&jobs.deferredLock);
+    pthread_cond_destroy(&jobs.wake);
+    pthread_mutex_destroy(&jobs.lock);
+    jobQueue = -1;
+}
+
+int JobThreads(void) {
+    return jobs.queues ? jobs.sizeOfThreads + 1 : 1;
+}
+
+void RegisterJobThread(void) {
+    if (!jobs.queues || jobQueue >= 0)
+        return;
+    int index = atomic_fetch_add(&jobs.sizeOfQueues, 1);
+    if (index >= jobs.capacityOfQueues) {
+        printf("JOB ERROR: no deque left for this thread, its jobs will run inline\n");
+        return;
+    }
+    jobQueue = index;
+    jobSeed = (unsigned int)index * 2654435761u;
+}
+
+void RunJob(JobFunc func, void *arg, int index, JobCounter *signal) {
+    RunJobAfter(NULL, func, arg, index, signal);
+}
+
+void RunJobAfter(JobCounter *dependency, JobFunc func, void *arg, int index, JobCounter *signal) {
+    if (signal)
+        atomic_fetch_add(&signal->value, 1);
+    Job job = {
+        .func = func,
+        .arg = arg,
+        .index = index,
+        .signal = signal,
+        .dependency = dependency
+    };
+    if (!jobs.queues || !dependency || atomic_load(&dependency->value) <= 0) {
+        SubmitJob(&job);
+        return;
+    }
+    pthread_mutex_lock(&jobs.deferredLock);
+    int n = atomic_load(&jobs.sizeOfDeferred);
+    if (n == JOB_MAX_DEFERRED) {
+        pthread_mutex_unlock(&jobs.deferredLock);
+        WaitForCounter(dependency);
+        SubmitJob(&job);
+        return;
+    }
+    jobs.deferred[n] = job;
+    atomic_store(&jobs.sizeOfDeferred, n + 1);
+    // Either this sees the dependency finish or its last job sees this parked
+    if (atomic_load(&dependency->value) <= 0) {
+        atomic_store(&jobs.sizeOfDeferred, n);
+        pthread_mutex_unlock(&jobs.deferredLock);
+        SubmitJob(&job);
+        return;
+    }
+    pthread_mutex_unlock(&jobs.deferredLock);
+}
+
+void WaitForCounter(JobCounter *counter) {
+    while (atomic_load_explicit(&counter->value, memory_order_acquire) > 0)
+        if (!jobs.queues || !RunNextJob())
+            YieldThread();
+}
+
+typedef struct {
+    JobFunc func;
+    void *arg;
+    int count, perJob;
+} ParallelRange;
+
+static void ParallelRangeJob(void *arg, int index) {
+    ParallelRange *range = arg;
+    int end = MIN(range->count, (index + 1) * range->perJob);
+    for (int i = index * range->perJob; i < end; i++)
+        range->func(range->arg, i);
+}
+
+void ParallelFor(JobFunc func, void *arg, int count) {
+    int threads = JobThreads();
+    if (count <= 1 || threads <= 1 || jobQueue < 0) {
+        for (int i = 0; i < count; i++)
+            func(arg, i);
+        return;
+    }
+    // A few ranges per thread so an uneven split still balances out
+    int ranges = MIN(count, threads * 4);
+    ParallelRange range = {
+        .func = func,
+        .arg = arg,
+        .count = count,
+        .perJob = (count + ranges - 1) / ranges
+    };
+    ranges = (count + range.perJob - 1) / range.perJob;
+    JobCounter done = {0};
+    for (int i = 0; i < ranges; i++)
+        RunJob(ParallelRangeJob, &range, i, &done);
+    WaitForCounter(&done);
+}
@@ -11,6 +11,9 @@
 #include <GLFW/glfw3.h>
 #include "ez/ezimage.h"
 #include <assert.h>
+#include <stdlib.h>
+#include <stdatomic.h>
+#include <pthread.h>
 #include "ez/ezmath.h"
 
 #define PLATFORM_POSIX
@@ -61,10 +64,30 @@ typedef struct {
 #define TO_FLOAT(V) ((float)(V) / 255.f)
 
 Texture LoadTexture(const char *path);
+// Decodes every image on the job system, uploads happen on the caller
+void LoadTextures(const char **paths, Texture *out, int count);
 Texture LoadTextureFromMemory(ezImage *image);
 
 void PushColor(Color color);
 
+// Maps a whole file read-only, NULL if it is missing or empty
+void* MapFile(const char *path, size_t *size);
+void UnmapFile(void *data, size_t size);
+// Atomically replaces to with from, anyone with the old file mapped keeps it
+int RenameFile(const char *from, const char *to);
+
+GLuint LoadShader(const char *vertex, const char *fragment);
+
+// Grows buffer to hold at least count items of size bytes. Capacity only
+// ever doubles, so scratch kept between frames settles at its high-water
+// mark and stops touching the heap.
+void* GrowBuffer(void *buffer, size_t *capacity, size_t count, size_t size);
+// Scratch memory that lives until the next ResetFrameArena. Allocations are
+// a pointer bump, anything that doesn't fit spills onto the heap and the
+// next reset grows the arena to cover it. Only the render thread uses it.
+void* FrameAlloc(size_t size);
+void ResetFrameArena(void);
+
 typedef struct {
     Vec3f position;
     float angle;
@@ -73,6 +96,73 @@ typedef struct {
 } Camera;
 
 #define MAX_ZOOM 256.f
+// Just short of level, at TWO_PI the ground is edge-on and can't be culled
+#define MAX_PITCH (TWO_PI - 1e-3f)
+// Camera changes smaller than this don't move anything on screen
+#define CAMERA_EPSILON 1e-4f
+
+// Hands the newest of a stream of fixed-size values from one writer thread to
+// one reader thread without locks. Each side owns a slot and they swap it
+// with the middle one, so neither ever waits and the reader always gets the
+// latest write, older unread ones are dropped.
+typedef struct {
+    uint8_t *data;
+    size_t sizeOfSlot;
+    int back, front;
+    atomic_int middle; // TRIPLE_BUFFER_FRESH is set until the reader takes it
+} TripleBuffer;
+
+#define TRIPLE_BUFFER_FRESH 4
+
+void InitTripleBuffer(TripleBuffer *buffer, size_t sizeOfSlot);
+void DestroyTripleBuffer(TripleBuffer *buffer);
+void* TripleBufferBack(TripleBuffer *buffer);
+int TripleBufferPublish(TripleBuffer *buffer);
+int TripleBufferFresh(TripleBuffer *buffer);
+void* TripleBufferAcquire(TripleBuffer *buffer);
+
+// Fixed-size queue for exactly one producer and one consumer thread. Nothing
+// is allocated after init, a push into a full buffer fails instead.
+typedef struct {
+    uint8_t *data;
+    size_t sizeOfItem;
+    size_t capacity; // power of two
+    atomic_size_t head; // next to pop, only the consumer moves it
+    atomic_size_t tail; // next to push, only the producer moves it
+} RingBuffer;
+
+void InitRingBuffer(RingBuffer *buffer, size_t sizeOfItem, size_t capacity);
+void DestroyRingBuffer(RingBuffer *buffer);
+int RingBufferPush(RingBuffer *buffer, const void *item);
+int RingBufferPop(RingBuffer *buffer, void *out);
+
+typedef void (*JobFunc)(void *arg, int index);
+
+// Counts jobs still to finish. Every job started with a counter adds one to
+// it and takes it back off once it is done, so zero means everything
+// tracked by it has finished. Start it at zero, e.g. JobCounter c = {0}.
+typedef struct {
+    atomic_int value;
+} JobCounter;
+
+int CPUCount(void);
+// Work-stealing scheduler shared by everything. Each thread that can run
+// jobs owns a deque, new jobs go on the spawning thread's own deque and idle
+// threads steal from the other end of everyone else's. threads counts the
+// caller, 0 uses every core. Until it is started every job runs inline.
+void InitJobSystem(int threads);
+void DestroyJobSystem(void);
+int JobThreads(void);
+// Gives a thread that isn't the one that started the system a deque of its
+// own, without one it can wait on jobs but the ones it starts run inline
+void RegisterJobThread(void);
+void RunJob(JobFunc func, void *arg, int index, JobCounter *signal);
+// Same as RunJob, but the job doesn't start until dependency reaches zero
+void RunJobAfter(JobCounter *dependency, JobFunc func, void *arg, int index, JobCounter *signal);
+// Runs other jobs while it waits, so it is fine to call from inside a job
+void WaitForCounter(JobCounter *counter);
+// Calls func for every index in [0, count) and returns once all are done
+void ParallelFor(JobFunc func, void *arg, int count);
 
 #endif /* common_h */
 
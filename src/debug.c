@@ -6,6 +6,7 @@
 //
 
 #include "debug.h"
+#include "alloc_debug.h"
 
 static struct {
     Texture font;
@@ -70,24 +71,22 @@ void DebugPrint(int _x, int _y, int vw, int vh, Color color, const char *string)
     }
 }
 
-#if !defined(_WIN32) && !defined(_WIN64)
-// Taken from: https://stackoverflow.com/a/4785411
-static int _vscprintf(const char *format, va_list pargs) {
-    va_list argcopy;
-    va_copy(argcopy, pargs);
-    int retval = vsnprintf(NULL, 0, format, argcopy);
-    va_end(argcopy);
-    return retval;
-}
-#endif
+// Overlay lines fit on the stack, longer ones go on the frame arena
+#define DEBUG_FORMAT_SIZE 256
 
 void DebugFormat(int x, int y, int vw, int vh, Color color, const char *fmt, ...) {
-    va_list args;
+    char buffer[DEBUG_FORMAT_SIZE];
+    va_list args, copy;
     va_start(args, fmt);
-    size_t size = _vscprintf(fmt, args) + 1;
-    char *str = malloc(sizeof(char) * size);
-    vsnprintf(str, size, fmt, args);
+    va_copy(copy, args);
+    int length = vsnprintf(buffer, sizeof(buffer), fmt, args);
     va_end(args);
-    DebugPrint(x, y, vw, vh, color, str);
-    free(str);
+    char *str = buffer;
+    if (length >= (int)sizeof(buffer)) {
+        str = FrameAlloc(length + 1);
+        vsnprintf(str, length + 1, fmt, copy);
+    }
+    va_end(copy);
+    if (length >= 0)
+        DebugPrint(x, y, vw, vh, color, str);
 }
@@ -0,0 +1,96 @@
+//
+//  frame.c
+//  tbce
+//
+//  Created by George Watson on 17/10/2026.
+//
+
+#include "frame.h"
+#if defined(PLATFORM_WINDOWS)
+#include <windows.h>
+#else
+#include <time.h>
+#include <sys/resource.h>
+#endif
+
+static void SleepFor(double seconds) {
+#if defined(PLATFORM_WINDOWS)
+    Sleep((DWORD)(seconds * 1000.0));
+#else
+    struct timespec ts = {
+        .tv_sec = (time_t)seconds,
+        .tv_nsec = (long)((seconds - (double)(time_t)seconds) * 1e9)
+    };
+    nanosleep(&ts, NULL);
+#endif
+}
+
+static double ProcessCpuTime(void) {
+#if defined(PLATFORM_WINDOWS)
+    FILETIME creation, exited, kernel, user;
+    if (!GetProcessTimes(GetCurrentProcess(), &creation, &exited, &kernel, &user))
+        return 0.0;
+    ULARGE_INTEGER k = { .LowPart = kernel.dwLowDateTime, .HighPart = kernel.dwHighDateTime };
+    ULARGE_INTEGER u = { .LowPart = user.dwLowDateTime, .HighPart = user.dwHighDateTime };
+    return (double)(k.QuadPart + u.QuadPart) * 1e-7;
+#else
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage))
+        return 0.0;
+    return (double)(usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) +
+           (double)(usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) * 1e-6;
+#endif
+}
+
+void InitFrameScheduler(FrameScheduler *scheduler, GLFWwindow *window, double fps) {
+    scheduler->window = window;
+    scheduler->frameCap = fps > 0.0 ? 1.0 / fps : 0.0;
+    scheduler->lastFrame = scheduler->sampleStart = glfwGetTime();
+    scheduler->sampleCpu = ProcessCpuTime();
+    scheduler->cpuUsage = 0.f;
+    scheduler->dirty = 1;
+}
+
+void MarkFrameDirty(FrameScheduler *scheduler) {
+    scheduler->dirty = 1;
+}
+
+// Only taken on frames that are drawn anyway, a fresh reading is never a
+// reason to wake up
+static void SampleCpuUsage(FrameScheduler *scheduler) {
+    double now = glfwGetTime();
+    if (now - scheduler->sampleStart < 1.0)
+        return;
+    double cpu = ProcessCpuTime();
+    scheduler->cpuUsage = (float)((cpu - scheduler->sampleCpu) / (now - scheduler->sampleStart) * 100.0);
+    scheduler->sampleStart = now;
+    scheduler->sampleCpu = cpu;
+}
+
+// Blocks until there is something to draw and the frame cap allows it. The
+// dirty flag is consumed, whoever renders has to set it again if the next
+// frame will look different (e.g. the camera is still easing). Returns 1 if
+// it had to wait for an event, the time since the last frame was spent idle.
+int WaitForFrame(FrameScheduler *scheduler) {
+    glfwPollEvents();
+    int blocked = 0;
+    while (!scheduler->dirty && !glfwWindowShouldClose(scheduler->window)) {
+        glfwWaitEvents();
+        blocked = 1;
+    }
+    SampleCpuUsage(scheduler);
+
+    if (scheduler->frameCap > 0.0) {
+        // Sleeps tend to overshoot by a millisecond or so, so sleep short of
+        // the deadline and yield through the rest
+        double target = scheduler->lastFrame + scheduler->frameCap;
+        double remaining;
+        while ((remaining = target - glfwGetTime()) > .002)
+            SleepFor(remaining - .002);
+        while (glfwGetTime() < target)
+            SleepFor(0.0);
+    }
+    scheduler->lastFrame = glfwGetTime();
+    scheduler->dirty = 0;
+    return blocked;
+}
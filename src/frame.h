@@ -0,0 +1,25 @@
+//
+//  frame.h
+//  tbce
+//
+//  Created by George Watson on 17/10/2026.
+//
+
+#ifndef frame_h
+#define frame_h
+#include "common.h"
+
+typedef struct {
+    GLFWwindow *window;
+    double frameCap; // shortest time between frames in seconds, 0 for uncapped
+    double lastFrame;
+    int dirty;
+    double sampleStart, sampleCpu;
+    float cpuUsage; // percent of one core, averaged since the last reading
+} FrameScheduler;
+
+void InitFrameScheduler(FrameScheduler *scheduler, GLFWwindow *window, double fps);
+void MarkFrameDirty(FrameScheduler *scheduler);
+int WaitForFrame(FrameScheduler *scheduler);
+
+#endif /* frame_h */
@@ -24,38 +24,99 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <assert.h>
+#include <pthread.h>
 
 #define EZ_IMPLEMENTATION
 #include "common.h"
 #include "map.h"
 #include "debug.h"
 #include "model.h"
+#include "bench.h"
+#include "frame.h"
+#include "sim.h"
+#include "alloc_debug.h"
+
+#define FRAME_MAX_TOGGLES 64
+#define INPUT_QUEUE_SIZE 1024
+
+typedef enum {
+    INPUT_KEY,
+    INPUT_BUTTON,
+    INPUT_MOUSE,
+    INPUT_SCROLL
+} InputEventType;
+
+typedef struct {
+    InputEventType type;
+    double time;
+    union {
+        struct {
+            int code, action, mods;
+        } key, button;
+        Vec2f position;
+        Vec2f scroll;
+    };
+} InputEvent;
+
+// Everything the render thread needs to draw one frame, written by the main
+// thread and never touched again once published
+typedef struct {
+    Camera camera;
+    Vec2i cursor;
+    int windowWidth, windowHeight;
+    int framebufferWidth, framebufferHeight;
+    MapRenderMode mode;
+    int meshing;
+    float cpuUsage;
+    double inputTime; // when the oldest input this frame responds to arrived
+    // walls toggled since the last snapshot the render thread took
+    Vec2i toggles[FRAME_MAX_TOGGLES];
+    int sizeOfToggles;
+    int quit;
+} FrameSnapshot;
 
 static struct {
     GLFWwindow *mainWindow;
-    Map map;
+    Map map; // owned by the render thread once it's running
     Camera camera;
     Camera cameraTarget;
     Texture tileTexture;
     Vec2i cursor;
+    RingBuffer input;
     Vec2f mousePosition;
-    Vec2f lastMousePosition;
+    Vec2f mouseDelta; // dragged this frame
     int m1Down;
     int ctrlDown;
     double lastTime;
     double deltaTime;
     Vec2f scrollDelta;
+    FrameScheduler scheduler;
+    Simulation sim;
+    MapRenderMode mode;
+    int meshing;
+    Vec2i *toggles;
+    int sizeOfToggles, capacityOfToggles;
     
     Model suzanne;
 } state;
 
+static struct {
+    pthread_t thread;
+    TripleBuffer frames;
+    // Only for sleeping while there's nothing new, the snapshots themselves
+    // are exchanged without it
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    double latency;
+} render;
+
 static void ClampCursor(int dx, int dy) {
     Vec2i old = state.cursor;
     Vec2i delta = (Vec2i){ dx, dy };
     Vec2i new = old + delta;
     state.cursor = (Vec2i) {
-        CLAMP(new.x, 0, state.map.w),
-        CLAMP(new.y, 0, state.map.h)
+        CLAMP(new.x, 0, state.map.w - 1),
+        CLAMP(new.y, 0, state.map.h - 1)
     };
     if (old.x != new.x || old.y != new.y)
         state.cameraTarget.position = Vec3New(state.cursor.x + .5f,
@@ -63,12 +124,9 @@ static void ClampCursor(int dx, int dy) {
                                               0.f);
 }
 
-static void KeyCallback(GLFWwindow* window, int key, int scancode, int action, int mods) {
+static void HandleKey(int key, int action, int mods) {
    if (key == GLFW_KEY_ESCAPE && action == GLFW_PRESS)
-       glfwSetWindowShouldClose(window, GLFW_TRUE);
-    
-    if (key == GLFW_KEY_LEFT_CONTROL || key == GLFW_KEY_RIGHT_CONTROL)
-        state.ctrlDown = action == GLFW_PRESS;
+       glfwSetWindowShouldClose(state.mainWindow, GLFW_TRUE);
     
     if (action == GLFW_RELEASE) {
         switch (key) {
@@ -78,7 +136,7 @@ static void KeyCallback(GLFWwindow* window, int key, int scancode, int action, i
                 break;
             case GLFW_KEY_KP_5:
                 state.cameraTarget.angle = TWO_PI;
-                state.cameraTarget.pitch = TWO_PI;
+                state.cameraTarget.pitch = MAX_PITCH;
                 break;
             case GLFW_KEY_KP_2:
                 state.cameraTarget.angle = PI * 2.f;
@@ -111,10 +169,10 @@ static void KeyCallback(GLFWwindow* window, int key, int scancode, int action, i
                 state.cameraTarget.zoom = CLAMP(state.cameraTarget.zoom + 5.f, .1, MAX_ZOOM);
                 break;
             case GLFW_KEY_KP_MULTIPLY:
-                state.cameraTarget.pitch = CLAMP(state.cameraTarget.pitch - .5f / PI, PI + HALF_PI, TWO_PI);
+                state.cameraTarget.pitch = CLAMP(state.cameraTarget.pitch - .5f / PI, PI + HALF_PI, MAX_PITCH);
                 break;
             case GLFW_KEY_KP_DIVIDE:
-                state.cameraTarget.pitch = CLAMP(state.cameraTarget.pitch + .5f / PI, PI + HALF_PI, TWO_PI);
+                state.cameraTarget.pitch = CLAMP(state.cameraTarget.pitch + .5f / PI, PI + HALF_PI, MAX_PITCH);
                 break;
                 
             case GLFW_KEY_LEFT:
@@ -133,27 +191,189 @@ static void KeyCallback(GLFWwindow* window, int key, int scancode, int action, i
             case GLFW_KEY_S:
                 ClampCursor(0, 1);
                 break;
+            case GLFW_KEY_G:
+                state.mode = state.mode == MAP_RENDER_CPU ? MAP_RENDER_GPU : MAP_RENDER_CPU;
+                break;
+            case GLFW_KEY_M:
+                state.meshing = !state.meshing;
+                break;
+            case GLFW_KEY_SPACE:
+                if (state.sizeOfToggles == state.capacityOfToggles) {
+                    state.capacityOfToggles = state.capacityOfToggles ? state.capacityOfToggles * 2 : 16;
+                    state.toggles = realloc(state.toggles, sizeof(Vec2i) * state.capacityOfToggles);
+                    assert(state.toggles);
+                }
+                state.toggles[state.sizeOfToggles++] = state.cursor;
+                break;
         }
     }
 }
 
+// Callbacks only record what happened, it's all applied in one place by
+// ProcessInput. A full queue drops the event rather than block or allocate.
+static void PushInput(InputEvent *event) {
+    event->time = glfwGetTime();
+    RingBufferPush(&state.input, event);
+    MarkFrameDirty(&state.scheduler);
+}
+
+static void KeyCallback(GLFWwindow* window, int key, int scancode, int action, int mods) {
+    InputEvent event = { .type = INPUT_KEY, .key = { key, action, mods } };
+    PushInput(&event);
+}
+
 static void ButtonCallback(GLFWwindow *window, int button, int action, int mods) {
-    if (button == GLFW_MOUSE_BUTTON_1) {
-        state.m1Down = action == GLFW_PRESS;
-        state.ctrlDown = mods & GLFW_MOD_CONTROL;
-    }
+    // Moves aren't queued between drags, so a drag starts from here
+    double x, y;
+    glfwGetCursorPos(window, &x, &y);
+    InputEvent moved = { .type = INPUT_MOUSE, .position = Vec2New(x, y) };
+    PushInput(&moved);
+    InputEvent event = { .type = INPUT_BUTTON, .button = { button, action, mods } };
+    PushInput(&event);
 }
 
 static void MouseCallback(GLFWwindow *window, double x, double y) {
-    state.lastMousePosition = state.mousePosition;
-    state.mousePosition = Vec2New(x, y);
+    // Moving the mouse only changes anything while dragging
+    if (glfwGetMouseButton(window, GLFW_MOUSE_BUTTON_1) != GLFW_PRESS)
+        return;
+    InputEvent event = { .type = INPUT_MOUSE, .position = Vec2New(x, y) };
+    PushInput(&event);
 }
 
 static void ScrollCallback(GLFWwindow *window, double xoff, double yoff) {
-    state.scrollDelta = Vec2New(xoff, yoff);
+    InputEvent event = { .type = INPUT_SCROLL, .scroll = Vec2New(xoff, yoff) };
+    PushInput(&event);
+}
+
+// Drains everything queued since the last frame in arrival order. Drag and
+// scroll are summed over the frame. Returns the time of the oldest event, or
+// 0 if there were none.
+static double ProcessInput(void) {
+    double oldest = 0.0;
+    state.mouseDelta = Vec2Zero();
+    state.scrollDelta = Vec2Zero();
+    InputEvent event;
+    while (RingBufferPop(&state.input, &event)) {
+        if (oldest == 0.0)
+            oldest = event.time;
+        switch (event.type) {
+            case INPUT_KEY:
+                if (event.key.code == GLFW_KEY_LEFT_CONTROL || event.key.code == GLFW_KEY_RIGHT_CONTROL)
+                    state.ctrlDown = event.key.action == GLFW_PRESS;
+                HandleKey(event.key.code, event.key.action, event.key.mods);
+                break;
+            case INPUT_BUTTON:
+                if (event.button.code == GLFW_MOUSE_BUTTON_1) {
+                    state.m1Down = event.button.action == GLFW_PRESS;
+                    state.ctrlDown = event.button.mods & GLFW_MOD_CONTROL;
+                }
+                break;
+            case INPUT_MOUSE:
+                if (state.m1Down)
+                    state.mouseDelta += event.position - state.mousePosition;
+                state.mousePosition = event.position;
+                break;
+            case INPUT_SCROLL:
+                state.scrollDelta += event.scroll;
+                break;
+        }
+    }
+    return oldest;
+}
+
+static void RefreshCallback(GLFWwindow *window) {
+    MarkFrameDirty(&state.scheduler);
+}
+
+static void PublishFrame(void) {
+    // If the last snapshot was never drawn its toggles come back with the
+    // slot, keep them ahead of the new ones instead of losing them
+    int dropped = TripleBufferPublish(&render.frames);
+    FrameSnapshot *back = TripleBufferBack(&render.frames);
+    if (!dropped) {
+        back->sizeOfToggles = 0;
+        back->inputTime = 0.0;
+    }
+    pthread_mutex_lock(&render.lock);
+    pthread_cond_signal(&render.wake);
+    pthread_mutex_unlock(&render.lock);
+}
+
+static void* RenderThread(void *arg) {
+    glfwMakeContextCurrent(state.mainWindow);
+    RegisterJobThread();
+#if !defined(NDEBUG)
+    size_t allocations = HeapAllocations();
+#endif
+    for (;;) {
+        pthread_mutex_lock(&render.lock);
+        while (!TripleBufferFresh(&render.frames))
+            pthread_cond_wait(&render.wake, &render.lock);
+        pthread_mutex_unlock(&render.lock);
+        FrameSnapshot *frame = TripleBufferAcquire(&render.frames);
+        if (frame->quit)
+            break;
+        
+        for (int i = 0; i < frame->sizeOfToggles; i++) {
+            Tile *tile = GetTile(&state.map, frame->toggles[i].x, frame->toggles[i].y);
+            if (!tile)
+                continue;
+            Tile toggled = *tile;
+            toggled.solid = !toggled.solid;
+            SetTile(&state.map, frame->toggles[i].x, frame->toggles[i].y, toggled);
+        }
+        // Everything from the last frame is done with by now
+        ResetFrameArena();
+        state.map.mode = frame->mode;
+        state.map.meshing = frame->meshing;
+        
+        glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+#if defined(PLATFORM_MAC)
+        glViewport(0, 0, frame->framebufferWidth, frame->framebufferHeight);
+#else
+        glViewport(0, 0, frame->windowWidth, frame->windowHeight);
+#endif
+        glHint(GL_PERSPECTIVE_CORRECTION_HINT, GL_NICEST);
+        int vw = frame->windowWidth, vh = frame->windowHeight;
+        Camera *camera = &frame->camera;
+        RenderMap(&state.map, vw, vh, camera, frame->cursor);
+        
+        RenderModel(&state.suzanne, 0, 0, camera);
+        
+        DebugFormat(8, 8, vw, vh, HEX(0xFFFF0000), "CAMERA: %f, %f\n", camera->position.x, camera->position.y);
+        DebugFormat(8, 16, vw, vh, HEX(0xFFFF0000), "        %f, %f %f\n", camera->angle, camera->pitch, camera->zoom);
+        DebugFormat(8, 24, vw, vh, HEX(0xFFFF0000), "MAP:    %s%s\n", frame->mode == MAP_RENDER_GPU ? "GPU" : "CPU", frame->meshing ? " (MESHED)" : "");
+        DebugFormat(8, 32, vw, vh, HEX(0xFFFF0000), "CPU:    %.1f%%\n", frame->cpuUsage);
+        DebugFormat(8, 40, vw, vh, HEX(0xFFFF0000), "INPUT:  %.1fms\n", render.latency * 1000.0);
+#if !defined(NDEBUG)
+        // Heap allocations this thread made while drawing, render jobs only
+        // fill scratch grown here. Should sit at 0 once warmed up.
+        size_t allocated = HeapAllocations();
+        DebugFormat(8, 48, vw, vh, HEX(0xFFFF0000), "ALLOCS: %zu\n", allocated - allocations);
+        allocations = allocated;
+#endif
+        
+        glfwSwapBuffers(state.mainWindow);
+        // Input to present, the overlay shows it a frame late
+        if (frame->inputTime > 0.0)
+            render.latency = glfwGetTime() - frame->inputTime;
+    }
+    glfwMakeContextCurrent(NULL);
+    return NULL;
+}
+
+static void LoadSuzanneJob(void *arg, int index) {
+    LoadModel("assets/suzanne.obj", &state.suzanne);
 }
 
 int main(int argc, const char* argv[]) {
+    if (argc > 1 && !strcmp(argv[1], "--bench"))
+        return RunBenchmarks(argc, argv);
+    // --fps 0 runs uncapped
+    double fps = 60.0;
+    for (int i = 1; i < argc - 1; i++)
+        if (!strcmp(argv[i], "--fps"))
+            fps = atof(argv[i + 1]);
     if (!glfwInit())
         return 0;
     if (!(state.mainWindow = glfwCreateWindow(640, 480, "tbce", NULL, NULL)))
@@ -166,6 +386,7 @@ int main(int argc, const char* argv[]) {
     glfwSetMouseButtonCallback(state.mainWindow, ButtonCallback);
     glfwSetCursorPosCallback(state.mainWindow, MouseCallback);
     glfwSetScrollCallback(state.mainWindow, ScrollCallback);
+    glfwSetWindowRefreshCallback(state.mainWindow, RefreshCallback);
     
     state.camera = (Camera) {
         .position = Vec3Zero(),
@@ -174,35 +395,52 @@ int main(int argc, const char* argv[]) {
         .zoom = 64.f
     };
     memcpy(&state.cameraTarget, &state.camera, sizeof(Camera));
+    InitSimulation(&state.sim, &state.camera);
+    InitJobSystem(0);
+    // The model doesn't touch GL, it parses while the rest is set up
+    JobCounter loading = {0};
+    RunJob(LoadSuzanneJob, NULL, 0, &loading);
     state.tileTexture = LoadTexture("assets/5z1KX.png");
     InitMap(&state.map, &state.tileTexture, 64, 64);
     InitDebug();
     double mouseX, mouseY;
     glfwGetCursorPos(state.mainWindow, &mouseX, &mouseY);
-    state.mousePosition = state.lastMousePosition = Vec2New(mouseX, mouseY);
+    state.mousePosition = Vec2New(mouseX, mouseY);
+    InitRingBuffer(&state.input, sizeof(InputEvent), INPUT_QUEUE_SIZE);
     state.lastTime = glfwGetTime();
     
-    LoadModelObj("assets/suzanne.obj", &state.suzanne);
+    WaitForCounter(&loading);
+    UploadModel(&state.suzanne);
+    InitFrameScheduler(&state.scheduler, state.mainWindow, fps);
+    
+    // GLFW wants events on the main thread, the GL context moves over to a
+    // render thread so drawing never holds up input and simulation
+    InitTripleBuffer(&render.frames, sizeof(FrameSnapshot));
+    pthread_mutex_init(&render.lock, NULL);
+    pthread_cond_init(&render.wake, NULL);
+    glfwMakeContextCurrent(NULL);
+    if (pthread_create(&render.thread, NULL, RenderThread, NULL)) {
+        printf("ERROR: failed to start render thread\n");
+        return 0;
+    }
     
     while (!glfwWindowShouldClose(state.mainWindow)) {
+        int resumed = WaitForFrame(&state.scheduler);
+        if (glfwWindowShouldClose(state.mainWindow))
+            break;
         double now = glfwGetTime();
-        state.deltaTime = now - state.lastTime;
+        // Time spent blocked on events isn't frame time, input waking the loop
+        // moves the camera as far as it would mid-drag. A slow frame still
+        // shouldn't count as one enormous step.
+        state.deltaTime = resumed ? SIM_TIMESTEP : MIN(now - state.lastTime, SIM_TIMESTEP * SIM_MAX_STEPS);
         state.lastTime = now;
-        glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-        
-        int windowWidth, windowHeight;
-        glfwGetWindowSize(state.mainWindow, &windowWidth, &windowHeight);
-#if defined(PLATFORM_MAC)
-        int framebufferWidth, framebufferHeight;
-        glfwGetFramebufferSize(state.mainWindow, &framebufferWidth, &framebufferHeight);
-        glViewport(0, 0, framebufferWidth, framebufferHeight);
-#else
-        glViewport(0, 0, windowWidth, windowHeight);
-#endif
-        glHint(GL_PERSPECTIVE_CORRECTION_HINT, GL_NICEST);
+        if (resumed)
+            ResumeSimulation(&state.sim);
+        // Events are only ever applied here, right after the poll
+        double inputTime = ProcessInput();
         
-        if (state.m1Down) {
-            Vec2f delta = state.mousePosition - state.lastMousePosition;
+        if (!Vec2Equals(state.mouseDelta, Vec2Zero())) {
+            Vec2f delta = state.mouseDelta;
             if (state.ctrlDown) {
                 float angle = state.cameraTarget.angle +  delta.x * 1.f * state.deltaTime;
                 if (angle > TWO_PI)
@@ -211,7 +449,7 @@ int main(int argc, const char* argv[]) {
                     state.cameraTarget.angle = TWO_PI + angle;
                 else
                     state.cameraTarget.angle = angle;
-                state.cameraTarget.pitch = CLAMP(state.cameraTarget.pitch + -delta.y * 1.f * state.deltaTime, PI + HALF_PI, TWO_PI);
+                state.cameraTarget.pitch = CLAMP(state.cameraTarget.pitch + -delta.y * 1.f * state.deltaTime, PI + HALF_PI, MAX_PITCH);
             } else {
                 Vec3f right = {
                     sinf(state.camera.angle + HALF_PI),
@@ -231,31 +469,42 @@ int main(int argc, const char* argv[]) {
         if (!Vec2Equals(state.scrollDelta, Vec2Zero()))
             state.cameraTarget.zoom  = CLAMP(state.cameraTarget.zoom + state.scrollDelta.y * 20.f * state.deltaTime, .1, MAX_ZOOM);
         
-        state.camera.position += (state.cameraTarget.position - state.camera.position) * 10.f * state.deltaTime;
-        float diff = state.cameraTarget.angle - state.camera.angle;
-        if (fabs(diff) > M_PI)
-           diff += (diff > 0 ? -2 : 2) * M_PI;
-        float angle = state.camera.angle + diff * 10.f * state.deltaTime;
-        if (angle > TWO_PI)
-            state.camera.angle = angle - TWO_PI;
-        else if (angle < 0)
-            state.camera.angle = TWO_PI + angle;
-        else
-            state.camera.angle = angle;
-        state.camera.pitch += (state.cameraTarget.pitch - state.camera.pitch) * 10.f * state.deltaTime;
-        state.camera.zoom += (state.cameraTarget.zoom - state.camera.zoom) * 10.f * state.deltaTime;
+        // The camera eases in fixed steps, the frame draws wherever it is
+        // between the last two
+        AdvanceSimulation(&state.sim, &state.cameraTarget, state.deltaTime);
+        InterpolateSimulation(&state.sim, &state.camera);
         
-        RenderMap(&state.map, windowWidth, windowHeight, &state.camera, state.cursor);
+        FrameSnapshot *frame = TripleBufferBack(&render.frames);
+        frame->camera = state.camera;
+        frame->cursor = state.cursor;
+        glfwGetWindowSize(state.mainWindow, &frame->windowWidth, &frame->windowHeight);
+        glfwGetFramebufferSize(state.mainWindow, &frame->framebufferWidth, &frame->framebufferHeight);
+        frame->mode = state.mode;
+        frame->meshing = state.meshing;
+        frame->cpuUsage = state.scheduler.cpuUsage;
+        if (frame->inputTime == 0.0)
+            frame->inputTime = inputTime;
+        frame->quit = 0;
+        int toggles = MIN(state.sizeOfToggles, FRAME_MAX_TOGGLES - frame->sizeOfToggles);
+        memcpy(frame->toggles + frame->sizeOfToggles, state.toggles, sizeof(Vec2i) * toggles);
+        frame->sizeOfToggles += toggles;
+        memmove(state.toggles, state.toggles + toggles, sizeof(Vec2i) * (state.sizeOfToggles - toggles));
+        state.sizeOfToggles -= toggles;
+        PublishFrame();
         
-        RenderModel(&state.suzanne, 0, 0, &state.camera);
-        
-        DebugFormat(8, 8, windowWidth, windowHeight, HEX(0xFFFF0000), "CAMERA: %f, %f\n", state.camera.position.x, state.camera.position.y);
-        DebugFormat(8, 16, windowWidth, windowHeight, HEX(0xFFFF0000), "        %f, %f %f\n", state.camera.angle, state.camera.pitch, state.camera.zoom);
-        
-        glfwSwapBuffers(state.mainWindow);
-        state.lastMousePosition = state.mousePosition;
-        state.scrollDelta = Vec2Zero();
-        glfwPollEvents();
+        // Keep drawing while anything is still moving, otherwise sleep until input
+        if (!SimulationSettled(&state.sim, &state.cameraTarget) || state.sizeOfToggles)
+            MarkFrameDirty(&state.scheduler);
     }
+    
+    FrameSnapshot *frame = TripleBufferBack(&render.frames);
+    frame->quit = 1;
+    PublishFrame();
+    pthread_join(render.thread, NULL);
+    DestroyTripleBuffer(&render.frames);
+    pthread_cond_destroy(&render.wake);
+    pthread_mutex_destroy(&render.lock);
+    DestroyRingBuffer(&state.input);
+    DestroyJobSystem();
     return 0;
 }
@@ -6,6 +6,13 @@
 //
 
 #include "map.h"
+#include <stddef.h>
+#if defined(__AVX__) || defined(__SSE__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+#include "alloc_debug.h"
 
 static const int faces[6][4] = {
     [FLOOR_FACE]   = { 4, 0, 1, 5 },
@@ -29,76 +36,917 @@ static Cube CUBE_POINTS = (Cube) {
     }
 };
 
-void ProjectToMap(int tx, int ty, int vw, int vh, Camera *camera, Vec3f *in, Vec3f *out, size_t length) {
-    for (int i = 0; i < length; i++)
-        out[i] = in[i] + Vec3New(tx - camera->position.x, 0.f, ty - camera->position.y);
-    for (int i = 0; i < 8; i++)
-        out[i] *= camera->zoom;
+void MakeProjection(int vw, int vh, Camera *camera, Projection *out) {
+    float zoom = camera->zoom;
     float sa = sinf(camera->angle);
     float ca = cosf(camera->angle);
-    for (int i = 0; i < length; i++)
-        out[i] = Vec3New(out[i].x * ca + out[i].z * sa,
-                         out[i].y,
-                         out[i].x * -sa + out[i].z * ca);
     float sp = sinf(camera->pitch);
     float cp = cosf(camera->pitch);
-    for (int i = 0; i < length; i++)
-        out[i] = Vec3New(out[i].x,
-                         out[i].y * cp - out[i].z * sp,
-                         out[i].y * sp + out[i].z * cp);
-    for (int i = 0; i < length; i++)
-        out[i] = Vec3New(out[i].x + (float)vw * .5f,
-                         out[i].y + (float)vh * .5f,
-                         out[i].z);
+    // zoom -> yaw around y -> pitch around x, folded into one matrix
+    float m[3][3] = {
+        {  zoom * ca,       0.f,        zoom * sa      },
+        {  zoom * sa * sp,  zoom * cp, -zoom * ca * sp },
+        { -zoom * sa * cp,  zoom * sp,  zoom * ca * cp }
+    };
+    memcpy(out->m, m, sizeof(m));
+    // world origin is the camera position, screen origin is the viewport centre
+    float cx = camera->position.x, cz = camera->position.y;
+    out->t[0] = (float)vw * .5f - (m[0][0] * cx + m[0][2] * cz);
+    out->t[1] = (float)vh * .5f - (m[1][0] * cx + m[1][2] * cz);
+    out->t[2] = -(m[2][0] * cx + m[2][2] * cz);
+    // The camera is orthographic, a perspective mode would clear this
+    out->affine = 1;
+}
+
+static inline Vec3f ProjectPoint(Projection *p, Vec3f v) {
+    return Vec3New(p->m[0][0] * v.x + p->m[0][1] * v.y + p->m[0][2] * v.z + p->t[0],
+                   p->m[1][0] * v.x + p->m[1][1] * v.y + p->m[1][2] * v.z + p->t[1],
+                   p->m[2][0] * v.x + p->m[2][1] * v.y + p->m[2][2] * v.z + p->t[2]);
+}
+
+void ProjectPoints(Projection *p, PointArray *in, PointArray *out, size_t length) {
+    size_t i = 0;
+#if defined(__AVX__)
+    for (int r = 0; r < 3; r++) {
+        float *dst = r == 0 ? out->x : r == 1 ? out->y : out->z;
+        __m256 m0 = _mm256_set1_ps(p->m[r][0]);
+        __m256 m1 = _mm256_set1_ps(p->m[r][1]);
+        __m256 m2 = _mm256_set1_ps(p->m[r][2]);
+        __m256 t  = _mm256_set1_ps(p->t[r]);
+        for (i = 0; i + 8 <= length; i += 8) {
+            __m256 v = _mm256_add_ps(_mm256_mul_ps(m0, _mm256_loadu_ps(in->x + i)), t);
+            v = _mm256_add_ps(v, _mm256_mul_ps(m1, _mm256_loadu_ps(in->y + i)));
+            v = _mm256_add_ps(v, _mm256_mul_ps(m2, _mm256_loadu_ps(in->z + i)));
+            _mm256_storeu_ps(dst + i, v);
+        }
+    }
+#elif defined(__SSE__)
+    for (int r = 0; r < 3; r++) {
+        float *dst = r == 0 ? out->x : r == 1 ? out->y : out->z;
+        __m128 m0 = _mm_set1_ps(p->m[r][0]);
+        __m128 m1 = _mm_set1_ps(p->m[r][1]);
+        __m128 m2 = _mm_set1_ps(p->m[r][2]);
+        __m128 t  = _mm_set1_ps(p->t[r]);
+        for (i = 0; i + 4 <= length; i += 4) {
+            __m128 v = _mm_add_ps(_mm_mul_ps(m0, _mm_loadu_ps(in->x + i)), t);
+            v = _mm_add_ps(v, _mm_mul_ps(m1, _mm_loadu_ps(in->y + i)));
+            v = _mm_add_ps(v, _mm_mul_ps(m2, _mm_loadu_ps(in->z + i)));
+            _mm_storeu_ps(dst + i, v);
+        }
+    }
+#elif defined(__ARM_NEON)
+    for (int r = 0; r < 3; r++) {
+        float *dst = r == 0 ? out->x : r == 1 ? out->y : out->z;
+        float32x4_t t = vdupq_n_f32(p->t[r]);
+        for (i = 0; i + 4 <= length; i += 4) {
+            float32x4_t v = vmlaq_n_f32(t, vld1q_f32(in->x + i), p->m[r][0]);
+            v = vmlaq_n_f32(v, vld1q_f32(in->y + i), p->m[r][1]);
+            v = vmlaq_n_f32(v, vld1q_f32(in->z + i), p->m[r][2]);
+            vst1q_f32(dst + i, v);
+        }
+    }
+#endif
+    // Scalar tail (or everything, when no SIMD is available)
+    for (; i < length; i++) {
+        Vec3f v = ProjectPoint(p, Vec3New(in->x[i], in->y[i], in->z[i]));
+        out->x[i] = v.x;
+        out->y[i] = v.y;
+        out->z[i] = v.z;
+    }
+}
+
+void ProjectToMap(int tx, int ty, int vw, int vh, Camera *camera, Vec3f *in, Vec3f *out, size_t length) {
+    Projection projection;
+    MakeProjection(vw, vh, camera, &projection);
+    Vec3f offset = Vec3New(tx, 0.f, ty);
+    for (size_t i = 0; i < length; i++)
+        out[i] = ProjectPoint(&projection, in[i] + offset);
 }
 
 static void CreateCube(int tx, int ty, int vw, int vh, Camera *camera, Vec3f *out) {
     ProjectToMap(tx, ty, vw, vh, camera, CUBE_POINTS.points, out, 8);
 }
 
-static Quad MakeQuad(Cube *cube, int a, int b, int c, int d) {
-    return (Quad) {
-        .points = {
-            [0] = cube->points[a],
-            [1] = cube->points[b],
-            [2] = cube->points[c],
-            [3] = cube->points[d]
-        }
-    };
+// Interleaves the low 8 bits of v with zeroes
+static inline uint32_t SpreadBits(uint32_t v) {
+    v = (v | (v << 4)) & 0x0F0F;
+    v = (v | (v << 2)) & 0x3333;
+    v = (v | (v << 1)) & 0x5555;
+    return v;
 }
 
-static Face MakeFace(Cube *cube, Tile *tile, TileFace _face, int a, int b, int c, int d) {
-    return (Face) {
-        .quad = MakeQuad(cube, a, b, c, d),
-        .tile = tile,
-        .face = _face
-    };
+static inline size_t TileIndex(Map *map, int x, int y) {
+    size_t chunk = (size_t)(y >> MAP_CHUNK_SHIFT) * map->chunksW + (x >> MAP_CHUNK_SHIFT);
+    uint32_t local = SpreadBits(x & (MAP_CHUNK_SIZE - 1)) | (SpreadBits(y & (MAP_CHUNK_SIZE - 1)) << 1);
+    return (chunk << (MAP_CHUNK_SHIFT * 2)) | local;
 }
 
-#define MAKE_FACE(I)                                                                                                  \
-do {                                                                                                                  \
-    if (visible[(I)] == 1) {                                                                                          \
-        Face face = MakeFace(&cube, tile, (TileFace)(I), faces[(I)][0], faces[(I)][1], faces[(I)][2], faces[(I)][3]); \
-        memcpy(&out[*n], &face, sizeof(Face));                                                                        \
-        (*n)++;                                                                                                       \
-    }                                                                                                                 \
+#define MAKE_FACE(I)                                    \
+do {                                                    \
+    if (visible[(I)] == 1 &&                            \
+        !(tile->neighbors & (1 << (I)))) {              \
+        out[*n] = (Face) {                              \
+            .points = {                                 \
+                base + corners[faces[(I)][0]],          \
+                base + corners[faces[(I)][1]],          \
+                base + corners[faces[(I)][2]],          \
+                base + corners[faces[(I)][3]]           \
+            },                                          \
+            .x = x,                                     \
+            .y = y,                                     \
+            .face = (TileFace)(I),                      \
+            .type = tile->type,                         \
+            .spanX = 1,                                 \
+            .spanY = 1                                  \
+        };                                              \
+        (*n)++;                                         \
+    }                                                   \
 } while(0)
 
-static void GetCubeFaces(Tile *tile, int vw, int vh, Camera *camera, int visible[6], Face *out, int *n) {
-    Cube cube;
-    CreateCube(tile->x, tile->y, vw, vh, camera, cube.points);
+// When flats is 0 floors and ceilings are left out, they're meshed separately
+static void GetCubeFaces(Tile *tile, int x, int y, uint32_t base, uint32_t corners[8], int visible[6], TileFace order[5], int flats, Face *out, size_t *n) {
     if (tile->solid) {
-        for (int i = 1; i < 6; i++)
-            MAKE_FACE(i);
-    } else
-        MAKE_FACE(0);
+        // the ceiling is always last in the order
+        for (int i = 0; i < (flats ? 5 : 4); i++)
+            MAKE_FACE(order[i]);
+    } else if (flats)
+        MAKE_FACE(FLOOR_FACE);
+}
+
+typedef struct {
+    int outerX;
+    int stepX, stepY;
+    TileFace order[5];
+} Traversal;
+
+// With an orthographic camera that only yaws and pitches, painter's order
+// over the grid only depends on which way the depth gradient points along
+// x and y, i.e. on which octant the camera angle falls in. Walking both axes
+// far-to-near is a valid back-to-front order for equal height cells, as any
+// two cells are separated by a grid plane.
+static void MakeTraversal(Camera *camera, Traversal *out) {
+    float angle = fmodf(camera->angle, TWO_PI);
+    if (angle < 0.f)
+        angle += TWO_PI;
+    int octant = (int)(angle / (PI * .25f)) & 7;
+    // depth grows with x when sin(angle) < 0, and with y when cos(angle) > 0
+    out->stepX = octant >= 4 ? 1 : -1;
+    out->stepY = octant <= 1 || octant >= 6 ? 1 : -1;
+    // walk the axis with the steeper depth gradient in the outer loop
+    out->outerX = octant == 1 || octant == 2 || octant == 5 || octant == 6;
+    
+    TileFace nearX = out->stepX > 0 ? WEST_FACE : SOUTH_FACE;
+    TileFace farX  = out->stepX > 0 ? SOUTH_FACE : WEST_FACE;
+    TileFace nearY = out->stepY > 0 ? EAST_FACE : NORTH_FACE;
+    TileFace farY  = out->stepY > 0 ? NORTH_FACE : EAST_FACE;
+    // Back faces first in case they survive culling edge-on, ceiling last
+    out->order[0] = farX;
+    out->order[1] = farY;
+    out->order[2] = out->outerX ? nearX : nearY;
+    out->order[3] = out->outerX ? nearY : nearX;
+    out->order[4] = CEILING_FACE;
+}
+
+static inline int TraverseAxis(int i, int length, int step) {
+    return step > 0 ? i : length - 1 - i;
+}
+
+typedef struct {
+    int x, y, w, h;
+    // Columns of each row the band on screen crosses, [begin, end) in map
+    // coordinates. Looking low at a diagonal the rectangle is mostly empty.
+    int *rowBegin, *rowEnd;
+    size_t tiles; // in all the rows together
+} TileRegion;
+
+// Row spans of the last region, kept between frames and only ever grown
+static struct {
+    int *begin, *end;
+    size_t sizeOfBegin, sizeOfEnd;
+} spans;
+
+static void ReserveSpans(TileRegion *region) {
+    spans.begin = GrowBuffer(spans.begin, &spans.sizeOfBegin, MAX(region->h, 1), sizeof(int));
+    spans.end = GrowBuffer(spans.end, &spans.sizeOfEnd, MAX(region->h, 1), sizeof(int));
+    region->rowBegin = spans.begin;
+    region->rowEnd = spans.end;
+}
+
+// Inverts the projection on the floor and ceiling planes to find where the
+// viewport corners land, plus a tile of margin. The band they enclose is the
+// hull of those eight points, so clipping every segment between them to a
+// row finds the ends of that row.
+static void VisibleRegion(Map *map, Projection *p, int vw, int vh, TileRegion *out) {
+    const int margin = 1;
+    float det = p->m[0][0] * p->m[1][2] - p->m[0][2] * p->m[1][0];
+    // Only edge-on at a pitch of TWO_PI, which the camera stops short of
+    if (fabsf(det) < 1e-6f) {
+        *out = (TileRegion) { 0, 0, map->w, map->h };
+        ReserveSpans(out);
+        for (int row = 0; row < map->h; row++) {
+            out->rowBegin[row] = 0;
+            out->rowEnd[row] = map->w;
+        }
+        out->tiles = (size_t)map->w * map->h;
+        return;
+    }
+    float px[8], py[8];
+    float xmin = INFINITY, xmax = -INFINITY, ymin = INFINITY, ymax = -INFINITY;
+    for (int level = 0; level < 2; level++)
+        for (int corner = 0; corner < 4; corner++) {
+            float sx = corner & 1 ? (float)vw : 0.f;
+            float sy = corner & 2 ? (float)vh : 0.f;
+            float bx = sx - p->t[0] + p->m[0][1] * level;
+            float by = sy - p->t[1] + p->m[1][1] * level;
+            float x = px[level * 4 + corner] = (bx * p->m[1][2] - p->m[0][2] * by) / det;
+            float y = py[level * 4 + corner] = (p->m[0][0] * by - p->m[1][0] * bx) / det;
+            xmin = MIN(xmin, x);
+            xmax = MAX(xmax, x);
+            ymin = MIN(ymin, y);
+            ymax = MAX(ymax, y);
+        }
+    // clamp before converting, near the horizon these get huge
+    int x0 = (int)floorf(CLAMP(xmin, -1.f, (float)map->w)) - margin;
+    int x1 = (int)floorf(CLAMP(xmax, -1.f, (float)map->w)) + 1 + margin;
+    int y0 = (int)floorf(CLAMP(ymin, -1.f, (float)map->h)) - margin;
+    int y1 = (int)floorf(CLAMP(ymax, -1.f, (float)map->h)) + 1 + margin;
+    x0 = MAX(x0, 0);
+    y0 = MAX(y0, 0);
+    x1 = MIN(x1, map->w);
+    y1 = MIN(y1, map->h);
+    *out = (TileRegion) { x0, y0, MAX(x1 - x0, 0), MAX(y1 - y0, 0) };
+    ReserveSpans(out);
+    out->tiles = 0;
+    for (int row = 0; row < out->h; row++) {
+        float top = (float)(out->y + row - margin), bottom = (float)(out->y + row + 1 + margin);
+        float lo = INFINITY, hi = -INFINITY;
+        // b == a covers corners that sit inside the row on their own
+        for (int a = 0; a < 8; a++)
+            for (int b = a; b < 8; b++) {
+                float t0 = 0.f, t1 = 1.f, dy = py[b] - py[a];
+                if (dy == 0.f) {
+                    if (py[a] < top || py[a] > bottom)
+                        continue;
+                } else {
+                    float ta = (top - py[a]) / dy, tb = (bottom - py[a]) / dy;
+                    t0 = MAX(t0, MIN(ta, tb));
+                    t1 = MIN(t1, MAX(ta, tb));
+                    if (t0 > t1)
+                        continue;
+                }
+                float xa = px[a] + (px[b] - px[a]) * t0;
+                float xb = px[a] + (px[b] - px[a]) * t1;
+                lo = MIN(lo, MIN(xa, xb));
+                hi = MAX(hi, MAX(xa, xb));
+            }
+        int begin = out->x, end = out->x;
+        if (lo <= hi) {
+            begin = MAX((int)floorf(CLAMP(lo, -1.f, (float)map->w)) - margin, out->x);
+            end = MIN((int)floorf(CLAMP(hi, -1.f, (float)map->w)) + 1 + margin, out->x + out->w);
+            end = MAX(end, begin);
+        }
+        out->rowBegin[row] = begin;
+        out->rowEnd[row] = end;
+        out->tiles += end - begin;
+    }
+}
+
+// Floor and ceiling corners of the tiles in a region, a row at a time. Row r
+// sits between tile rows r - 1 and r and only holds the corners those two
+// need, packed straight after the row before.
+typedef struct {
+    int *begin; // first column of each row
+    uint32_t *base; // first point of each row, one past the last at the end
+    uint32_t layer; // points per level, ceiling points follow the floor's
+} Lattice;
+
+static inline uint32_t LatticeIndex(Lattice *lattice, int x, int row) {
+    return lattice->base[row] + (uint32_t)(x - lattice->begin[row]);
+}
+
+// Row a lattice point belongs to, the last row starting at or before it
+// is never one without points
+static int LatticeRow(Lattice *lattice, int rows, uint32_t point) {
+    int lo = 0, hi = rows - 1;
+    while (lo < hi) {
+        int mid = (lo + hi + 1) / 2;
+        if (lattice->base[mid] <= point)
+            lo = mid;
+        else
+            hi = mid - 1;
+    }
+    return lo;
+}
+
+// Offsets of a tile's eight corners from its first floor corner, they only
+// change from row to row
+static void LatticeCorners(Lattice *lattice, int row, uint32_t corners[8]) {
+    uint32_t next = (lattice->base[row + 1] - (uint32_t)lattice->begin[row + 1]) -
+                    (lattice->base[row] - (uint32_t)lattice->begin[row]);
+    for (int i = 0; i < 8; i++)
+        corners[i] = (uint32_t)CUBE_POINTS.points[i].x +
+                     (CUBE_POINTS.points[i].z > 0.f ? next : 0) +
+                     (CUBE_POINTS.points[i].y < 0.f ? lattice->layer : 0);
+}
+
+// Per-frame working memory, kept between frames and only ever grown
+static struct {
+    float *points;
+    size_t sizeOfPoints;
+    Face *faces;
+    size_t sizeOfFaces;
+    uint8_t *visited;
+    size_t sizeOfVisited;
+    size_t *offsets;
+    size_t sizeOfOffsets;
+    void *chunkVertices;
+    size_t sizeOfChunkVertices;
+    size_t *visitedRows;
+    size_t sizeOfVisitedRows;
+    int *latticeBegin;
+    size_t sizeOfLatticeBegin;
+    uint32_t *latticeBase;
+    size_t sizeOfLatticeBase;
+    int *columnBegin, *columnEnd;
+    size_t sizeOfColumnBegin, sizeOfColumnEnd;
+} scratch;
+
+static inline int SameFlat(Map *map, Tile *tile, int solid, TileFace face, uint16_t sprite) {
+    return tile->solid == solid && map->types[tile->type].sprites[face] == sprite;
+}
+
+// Greedily merges runs of floors (or ceilings) sharing a sprite into
+// rectangles. Floors sit on the lowest plane and ceilings on the highest, and
+// the camera always looks down, so floors can't cover anything and nothing
+// can cover a ceiling. That lets the merged rectangles go before and after
+// the walls respectively without breaking painter's order.
+static void MeshFlatFaces(Map *map, TileRegion *region, Lattice *lattice, TileFace face, Face *out, size_t *n) {
+    int solid = face == CEILING_FACE;
+    uint32_t level = solid ? lattice->layer : 0;
+    // One flag per tile in the spans, row after row
+    scratch.visitedRows = GrowBuffer(scratch.visitedRows, &scratch.sizeOfVisitedRows, region->h + 1, sizeof(size_t));
+    size_t *rows = scratch.visitedRows;
+    rows[0] = 0;
+    for (int y = 0; y < region->h; y++)
+        rows[y + 1] = rows[y] + (region->rowEnd[y] - region->rowBegin[y]);
+    scratch.visited = GrowBuffer(scratch.visited, &scratch.sizeOfVisited, MAX(rows[region->h], 1), sizeof(uint8_t));
+    uint8_t *visited = scratch.visited;
+    memset(visited, 0, rows[region->h]);
+#define VISITED(X, Y) visited[rows[(Y)] + ((X) - region->rowBegin[(Y)])]
+    for (int y = 0; y < region->h; y++)
+        for (int mx = region->rowBegin[y]; mx < region->rowEnd[y]; mx++) {
+            if (VISITED(mx, y))
+                continue;
+            int my = region->y + y;
+            Tile *tile = &map->tiles[TileIndex(map, mx, my)];
+            if (tile->solid != solid)
+                continue;
+            uint16_t sprite = map->types[tile->type].sprites[face];
+            int w = 1, h = 1;
+            while (mx + w < region->rowEnd[y] && !VISITED(mx + w, y) &&
+                   SameFlat(map, &map->tiles[TileIndex(map, mx + w, my)], solid, face, sprite))
+                w++;
+            // Rows only join while they cover the whole run
+            for (; y + h < region->h; h++) {
+                if (region->rowBegin[y + h] > mx || region->rowEnd[y + h] < mx + w)
+                    break;
+                int i = 0;
+                while (i < w && !VISITED(mx + i, y + h) &&
+                       SameFlat(map, &map->tiles[TileIndex(map, mx + i, my + h)], solid, face, sprite))
+                    i++;
+                if (i < w)
+                    break;
+            }
+            for (int j = 0; j < h; j++)
+                memset(&VISITED(mx, y + j), 1, w);
+            
+            Face *result = &out[(*n)++];
+            for (int i = 0; i < 4; i++) {
+                Vec3f p = CUBE_POINTS.points[faces[face][i]];
+                result->points[i] = LatticeIndex(lattice, mx + (p.x > 0.f ? w : 0), y + (p.z > 0.f ? h : 0)) + level;
+            }
+            result->x = mx;
+            result->y = my;
+            result->face = face;
+            result->type = tile->type;
+            result->spanX = w;
+            result->spanY = h;
+        }
+#undef VISITED
+}
+
+// Build with -DMAP_VALIDATE_ORDER to check the traversal order against a
+// depth sort of the same faces every frame
+#if defined(MAP_VALIDATE_ORDER)
+typedef struct {
+    uint32_t key;
+    uint32_t index;
+} DepthKey;
+
+static struct {
+    DepthKey *keys;
+    size_t capacity;
+} sorter;
+
+static inline uint32_t DepthToKey(float depth) {
+    // Flip the sign bit of positives and every bit of negatives so the
+    // unsigned integer order matches the float order
+    uint32_t bits;
+    memcpy(&bits, &depth, sizeof(float));
+    return bits ^ ((bits >> 31) ? 0xFFFFFFFFu : 0x80000000u);
 }
 
-static int SortFaces(const void *faceA, const void *faceB) {
-    Face *fa = (Face*)faceA;
-    Face *fb = (Face*)faceB;
-    return (fa->quad.points[0].z + fa->quad.points[1].z + fa->quad.points[2].z + fa->quad.points[3].z) * .25f -
-           (fb->quad.points[0].z + fb->quad.points[1].z + fb->quad.points[2].z + fb->quad.points[3].z) * .25f;
+// Stable LSD radix sort, 8 bits per pass. Passes where every key shares the
+// same digit are skipped. Returns whichever of the two buffers holds the result
+static DepthKey* RadixSortKeys(DepthKey *keys, DepthKey *scratch, size_t length) {
+    size_t histogram[4][256];
+    memset(histogram, 0, sizeof(histogram));
+    for (size_t i = 0; i < length; i++)
+        for (int pass = 0; pass < 4; pass++)
+            histogram[pass][(keys[i].key >> (pass * 8)) & 0xFF]++;
+    DepthKey *src = keys, *dst = scratch;
+    for (int pass = 0; pass < 4 && length; pass++) {
+        int shift = pass * 8;
+        size_t *bucket = histogram[pass];
+        if (bucket[(src[0].key >> shift) & 0xFF] == length)
+            continue;
+        size_t offset = 0;
+        for (int i = 0; i < 256; i++) {
+            size_t n = bucket[i];
+            bucket[i] = offset;
+            offset += n;
+        }
+        for (size_t i = 0; i < length; i++)
+            dst[bucket[(src[i].key >> shift) & 0xFF]++] = src[i];
+        DepthKey *tmp = src;
+        src = dst;
+        dst = tmp;
+    }
+    return src;
+}
+
+static DepthKey* SortFaces(Face *faces, float *depth, size_t length) {
+    sorter.keys = GrowBuffer(sorter.keys, &sorter.capacity, length * 2, sizeof(DepthKey));
+    DepthKey *keys = sorter.keys;
+    for (size_t i = 0; i < length; i++) {
+        uint32_t *p = faces[i].points;
+        keys[i] = (DepthKey) {
+            .key = DepthToKey((depth[p[0]] + depth[p[1]] + depth[p[2]] + depth[p[3]]) * .25f),
+            .index = (uint32_t)i
+        };
+    }
+    return RadixSortKeys(keys, keys + length, length);
+}
+
+// Separating axis test between two convex screen-space quads. Touching
+// edges don't count, neighbouring faces always share one.
+static int QuadsOverlap(Vec2f a[4], Vec2f b[4]) {
+    for (int q = 0; q < 2; q++) {
+        Vec2f *edges = q ? b : a;
+        for (int i = 0; i < 4; i++) {
+            Vec2f edge = edges[(i + 1) & 3] - edges[i];
+            Vec2f axis = Vec2New(-edge.y, edge.x);
+            float amin = INFINITY, amax = -INFINITY, bmin = INFINITY, bmax = -INFINITY;
+            for (int j = 0; j < 4; j++) {
+                float pa = axis.x * a[j].x + axis.y * a[j].y;
+                float pb = axis.x * b[j].x + axis.y * b[j].y;
+                amin = MIN(amin, pa);
+                amax = MAX(amax, pa);
+                bmin = MIN(bmin, pb);
+                bmax = MAX(bmax, pb);
+            }
+            if (MIN(amax, bmax) - MAX(amin, bmin) <= 1e-2f * Vec2Length(axis))
+                return 0;
+        }
+    }
+    return 1;
+}
+
+static void ValidateFaceOrder(Face *faces, PointArray *screen, size_t length, size_t window) {
+    DepthKey *order = SortFaces(faces, screen->z, length);
+    uint32_t *rank = FrameAlloc(sizeof(uint32_t) * length);
+    float (*range)[2] = FrameAlloc(sizeof(float) * 2 * length);
+    for (size_t i = 0; i < length; i++) {
+        rank[order[i].index] = (uint32_t)i;
+        uint32_t *p = faces[i].points;
+        float *z = screen->z;
+        range[i][0] = MIN(MIN(z[p[0]], z[p[1]]), MIN(z[p[2]], z[p[3]]));
+        range[i][1] = MAX(MAX(z[p[0]], z[p[1]]), MAX(z[p[2]], z[p[3]]));
+    }
+    // Only faces that overlap on screen and don't overlap in depth have an
+    // order both paths must agree on. Faces within a cell of each other are
+    // where a traversal mistake would show up, so only compare those.
+    int mismatches = 0;
+    for (size_t i = 0; i < length; i++)
+        for (size_t j = i + 1; j < length && j < i + window; j++) {
+            if (abs(faces[i].x - faces[j].x) > 1 ||
+                abs(faces[i].y - faces[j].y) > 1)
+                continue;
+            int disjoint = range[j][1] < range[i][0] - 1e-3f || range[i][1] < range[j][0] - 1e-3f;
+            if (!disjoint || rank[j] > rank[i])
+                continue;
+            Vec2f a[4], b[4];
+            for (int k = 0; k < 4; k++) {
+                a[k] = Vec2New(screen->x[faces[i].points[k]], screen->y[faces[i].points[k]]);
+                b[k] = Vec2New(screen->x[faces[j].points[k]], screen->y[faces[j].points[k]]);
+            }
+            if (QuadsOverlap(a, b))
+                mismatches++;
+        }
+    if (mismatches)
+        printf("MAP ORDER: %d face pairs disagree with depth sort\n", mismatches);
+}
+#endif
+
+// Stream vertices are x, y then the texcoords. Projective quads need all of
+// s, t, r, q; affine ones only s, t, plus r to carry the sprite when meshed.
+static inline int MapTexCoordSize(int affine, int meshed) {
+    return !affine ? 4 : meshed ? 3 : 2;
+}
+
+// With meshing on, texcoords carry tile-local coordinates and the sprite
+// index instead of atlas UVs, so a merged rectangle can repeat its sprite
+// across the atlas cell with fract()
+static const char *tiledVertexShader =
+    "#version 120\n"
+    "void main() {\n"
+    "    gl_Position = ftransform();\n"
+    "    gl_TexCoord[0] = gl_MultiTexCoord0;\n"
+    "}\n";
+
+static const char *tiledFragmentShader =
+    "#version 120\n"
+    "uniform sampler2D spritesheet;\n"
+    "uniform float columns;\n"
+    "uniform vec2 cell;\n"
+    "void main() {\n"
+    "    vec3 t = gl_TexCoord[0].stp / gl_TexCoord[0].q;\n"
+    "    float sprite = floor(t.z + .5);\n"
+    "    float row = floor((sprite + .5) / columns);\n"
+    "    vec2 origin = vec2(sprite - row * columns, row);\n"
+    "    gl_FragColor = texture2D(spritesheet, (origin + fract(t.xy)) * cell);\n"
+    "}\n";
+
+static struct {
+    GLuint program;
+    GLint spritesheet, columns, cell;
+    int failed;
+} tiled;
+
+static int LoadTiledProgram(void) {
+    if (!tiled.program && !tiled.failed) {
+        if (!(tiled.program = LoadShader(tiledVertexShader, tiledFragmentShader))) {
+            tiled.failed = 1;
+            return 0;
+        }
+        tiled.spritesheet = glGetUniformLocation(tiled.program, "spritesheet");
+        tiled.columns = glGetUniformLocation(tiled.program, "columns");
+        tiled.cell = glGetUniformLocation(tiled.program, "cell");
+    }
+    return tiled.program != 0;
+}
+
+static struct {
+    GLuint vbo, ibo;
+    size_t capacity;
+    size_t sizeOfIndices;
+} stream;
+
+// Quads are drawn as two triangles from a static index buffer that only
+// grows, shared by the streaming and resident paths
+static void ReserveQuadIndices(size_t quads) {
+    if (!stream.ibo)
+        glGenBuffers(1, &stream.ibo);
+    if (quads <= stream.sizeOfIndices)
+        return;
+    size_t capacity = stream.sizeOfIndices ? stream.sizeOfIndices : 1024;
+    while (capacity < quads)
+        capacity *= 2;
+    // Only runs when the quad count grows, never in steady state
+    uint32_t *indices = malloc(sizeof(uint32_t) * 6 * capacity);
+    for (uint32_t i = 0; i < capacity; i++) {
+        static const uint32_t fan[6] = { 0, 1, 2, 0, 2, 3 };
+        for (int j = 0; j < 6; j++)
+            indices[i * 6 + j] = i * 4 + fan[j];
+    }
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, stream.ibo);
+    glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(uint32_t) * 6 * capacity, indices, GL_STATIC_DRAW);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+    free(indices);
+    stream.sizeOfIndices = capacity;
+}
+
+// The vertex buffer is orphaned every frame, so the driver can hand back
+// fresh storage instead of stalling on last frame's draw
+static float* BeginMapStream(size_t quads, size_t sizeOfVertex) {
+    if (!stream.vbo)
+        glGenBuffers(1, &stream.vbo);
+    if (quads > stream.capacity) {
+        size_t capacity = stream.capacity ? stream.capacity : 1024;
+        while (capacity < quads)
+            capacity *= 2;
+        stream.capacity = capacity;
+    }
+    ReserveQuadIndices(stream.capacity);
+    glBindBuffer(GL_ARRAY_BUFFER, stream.vbo);
+    glBufferData(GL_ARRAY_BUFFER, sizeOfVertex * 4 * stream.capacity, NULL, GL_STREAM_DRAW);
+    float *result = glMapBuffer(GL_ARRAY_BUFFER, GL_WRITE_ONLY);
+    if (!result)
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+    return result;
+}
+
+static int EndMapStream(void) {
+    // Unmapping can fail if the storage was lost, skip the frame then
+    int result = glUnmapBuffer(GL_ARRAY_BUFFER);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    return result;
+}
+
+// The streamed vertices stay valid until the next upload, so a frame where
+// nothing moved only draws them again
+static struct {
+    Map *map;
+    Camera camera;
+    int vw, vh;
+    unsigned int revision;
+    int meshed;
+    size_t quads;
+    int sizeOfTexCoord;
+    int valid;
+} cache;
+
+static int CacheMatches(Map *map, int vw, int vh, Camera *camera, int meshed) {
+    return cache.valid && cache.map == map &&
+           cache.revision == map->revision && cache.meshed == meshed &&
+           cache.vw == vw && cache.vh == vh &&
+           fabsf(cache.camera.position.x - camera->position.x) < CAMERA_EPSILON &&
+           fabsf(cache.camera.position.y - camera->position.y) < CAMERA_EPSILON &&
+           fabsf(cache.camera.angle - camera->angle) < CAMERA_EPSILON &&
+           fabsf(cache.camera.pitch - camera->pitch) < CAMERA_EPSILON &&
+           fabsf(cache.camera.zoom - camera->zoom) < CAMERA_EPSILON;
+}
+
+static void DrawMapStream(Map *map, size_t quads, int meshed, int sizeOfTexCoord) {
+    if (!quads)
+        return;
+    glEnable(GL_TEXTURE_2D);
+    glEnable(GL_BLEND);
+    glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+    glBindTexture(GL_TEXTURE_2D, map->spritesheet.id);
+    glColor4f(1.f, 1.f, 1.f, 1.f);
+    if (meshed) {
+        glUseProgram(tiled.program);
+        glUniform1i(tiled.spritesheet, 0);
+        glUniform1f(tiled.columns, (float)map->columns);
+        glUniform2f(tiled.cell, 32.f / (float)map->spritesheet.width, 32.f / (float)map->spritesheet.height);
+    }
+    
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, stream.ibo);
+    glEnableClientState(GL_VERTEX_ARRAY);
+    glEnableClientState(GL_TEXTURE_COORD_ARRAY);
+    glBindBuffer(GL_ARRAY_BUFFER, stream.vbo);
+    GLsizei stride = (GLsizei)(sizeof(float) * (2 + sizeOfTexCoord));
+    glVertexPointer(2, GL_FLOAT, stride, NULL);
+    glTexCoordPointer(sizeOfTexCoord, GL_FLOAT, stride, (void*)(sizeof(float) * 2));
+    glDrawElements(GL_TRIANGLES, (GLsizei)(quads * 6), GL_UNSIGNED_INT, NULL);
+    glDisableClientState(GL_TEXTURE_COORD_ARRAY);
+    glDisableClientState(GL_VERTEX_ARRAY);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    if (meshed)
+        glUseProgram(0);
+}
+
+static void SpriteUVs(Map *map, uint16_t sprite, Vec2f out[4]) {
+    Vec2f scale = Vec2New(1.f / (float)map->spritesheet.width,
+                          1.f / (float)map->spritesheet.height);
+    Vec2i offset = (Vec2i){ sprite % map->columns, sprite / map->columns } * 32;
+    Vec2f uvtl = Vec2New(offset.x, offset.y) * scale;
+    Vec2f uvbr = uvtl + (Vec2New(32.f, 32.f) * scale);
+    out[0] = Vec2New(uvtl.x, uvtl.y);
+    out[1] = Vec2New(uvtl.x, uvbr.y);
+    out[2] = Vec2New(uvbr.x, uvbr.y);
+    out[3] = Vec2New(uvbr.x, uvtl.y);
+}
+
+typedef struct {
+    float x, y, z;
+    float s, t;
+} TileVertex;
+
+// The resident path keeps untransformed tile geometry in a static buffer and
+// projects it in a vertex shader, so the CPU only uploads the camera. GLSL
+// 1.20 keeps it working on the macOS legacy context and on Mesa llvmpipe.
+static const char *residentVertexShader =
+    "#version 120\n"
+    "uniform mat3 projection;\n"
+    "uniform vec3 translation;\n"
+    "uniform vec2 viewport;\n"
+    "uniform vec2 depth;\n"
+    "void main() {\n"
+    "    vec3 p = projection * gl_Vertex.xyz + translation;\n"
+    "    gl_Position = vec4(p.x / viewport.x * 2. - 1.,\n"
+    "                       1. - p.y / viewport.y * 2.,\n"
+    "                       p.z * depth.x + depth.y,\n"
+    "                       1.);\n"
+    "    gl_TexCoord[0] = gl_MultiTexCoord0;\n"
+    "}\n";
+
+static const char *residentFragmentShader =
+    "#version 120\n"
+    "uniform sampler2D spritesheet;\n"
+    "void main() {\n"
+    "    gl_FragColor = texture2D(spritesheet, gl_TexCoord[0].st);\n"
+    "}\n";
+
+static struct {
+    GLuint program;
+    GLint projection, translation, viewport, depth, spritesheet;
+    int failed;
+} resident;
+
+static inline int SolidFaceCount(Tile *tile) {
+    return tile->solid ? __builtin_popcount(0x3E & ~tile->neighbors) : 1;
+}
+
+static void BuildResidentChunk(Map *map, int cx, int cy) {
+    MapChunk *chunk = &map->chunks[cy * map->chunksW + cx];
+    int x0 = cx * MAP_CHUNK_SIZE, x1 = MIN(x0 + MAP_CHUNK_SIZE, map->w);
+    int y0 = cy * MAP_CHUNK_SIZE, y1 = MIN(y0 + MAP_CHUNK_SIZE, map->h);
+    size_t quads = 0;
+    for (int y = y0; y < y1; y++)
+        for (int x = x0; x < x1; x++)
+            quads += SolidFaceCount(&map->tiles[TileIndex(map, x, y)]);
+    scratch.chunkVertices = GrowBuffer(scratch.chunkVertices, &scratch.sizeOfChunkVertices, 4 * quads, sizeof(TileVertex));
+    TileVertex *vertices = scratch.chunkVertices;
+    TileVertex *v = vertices;
+    for (int y = y0; y < y1; y++)
+        for (int x = x0; x < x1; x++) {
+            Tile *tile = &map->tiles[TileIndex(map, x, y)];
+            int first = tile->solid ? NORTH_FACE : FLOOR_FACE;
+            int last = tile->solid ? CEILING_FACE : FLOOR_FACE;
+            for (int i = first; i <= last; i++) {
+                if (tile->neighbors & (1 << i))
+                    continue;
+                Vec2f *uvs = map->types[tile->type].uvs[i];
+                for (int j = 0; j < 4; j++) {
+                    Vec3f p = CUBE_POINTS.points[faces[i][j]];
+                    v[j] = (TileVertex) {
+                        .x = x + p.x,
+                        .y = p.y,
+                        .z = y + p.z,
+                        .s = uvs[j].x,
+                        .t = uvs[j].y
+                    };
+                }
+                v += 4;
+            }
+        }
+    if (!chunk->geometry) {
+        glGenBuffers(1, &chunk->geometry);
+        map->residentChunks = GrowBuffer(map->residentChunks, &map->capacityOfResidentChunks, map->sizeOfResidentChunks + 1, sizeof(int));
+        map->residentChunks[map->sizeOfResidentChunks++] = cy * map->chunksW + cx;
+    }
+    glBindBuffer(GL_ARRAY_BUFFER, chunk->geometry);
+    glBufferData(GL_ARRAY_BUFFER, sizeof(TileVertex) * 4 * quads, vertices, GL_STATIC_DRAW);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    chunk->sizeOfGeometry = quads;
+    chunk->dirty = 0;
+}
+
+// Resident frames a chunk can go undrawn before its VBO is freed, so GPU
+// memory follows what has been on screen lately rather than the whole map
+#define MAP_RESIDENT_FRAMES 120
+
+static void EvictResidentChunks(Map *map) {
+    size_t kept = 0;
+    for (size_t i = 0; i < map->sizeOfResidentChunks; i++) {
+        MapChunk *chunk = &map->chunks[map->residentChunks[i]];
+        if (map->residentFrame - chunk->drawn < MAP_RESIDENT_FRAMES) {
+            map->residentChunks[kept++] = map->residentChunks[i];
+            continue;
+        }
+        glDeleteBuffers(1, &chunk->geometry);
+        chunk->geometry = 0;
+        chunk->sizeOfGeometry = 0;
+        chunk->dirty = 1;
+    }
+    map->sizeOfResidentChunks = kept;
+}
+
+// Geometry is kept per chunk, built the first time a chunk is drawn and
+// rebuilt only after SetTile touches it
+static int RenderResidentMap(Map *map, int vw, int vh, Projection *projection, TileRegion *region) {
+    if (!resident.program && !resident.failed) {
+        if (!(resident.program = LoadShader(residentVertexShader, residentFragmentShader))) {
+            resident.failed = 1;
+            return 0;
+        }
+        resident.projection = glGetUniformLocation(resident.program, "projection");
+        resident.translation = glGetUniformLocation(resident.program, "translation");
+        resident.viewport = glGetUniformLocation(resident.program, "viewport");
+        resident.depth = glGetUniformLocation(resident.program, "depth");
+        resident.spritesheet = glGetUniformLocation(resident.program, "spritesheet");
+    }
+    if (!resident.program)
+        return 0;
+    ReserveQuadIndices(MAP_CHUNK_SIZE * MAP_CHUNK_SIZE * 5);
+    
+    // Fit the depth range to the region's bounding box, nearer (larger z)
+    // maps to smaller NDC depth
+    float zmin = INFINITY, zmax = -INFINITY;
+    for (int i = 0; i < 8; i++) {
+        Vec3f corner = CUBE_POINTS.points[i] * Vec3New(region->w, 1.f, region->h) + Vec3New(region->x, 0.f, region->y);
+        float z = ProjectPoint(projection, corner).z;
+        zmin = MIN(zmin, z);
+        zmax = MAX(zmax, z);
+    }
+    float half = MAX((zmax - zmin) * .5f, 1e-3f) * 1.01f;
+    float mid = (zmax + zmin) * .5f;
+    
+    glUseProgram(resident.program);
+    glUniformMatrix3fv(resident.projection, 1, GL_TRUE, &projection->m[0][0]);
+    glUniform3fv(resident.translation, 1, projection->t);
+    glUniform2f(resident.viewport, (float)vw, (float)vh);
+    glUniform2f(resident.depth, -1.f / half, mid / half);
+    glUniform1i(resident.spritesheet, 0);
+    glActiveTexture(GL_TEXTURE0);
+    glBindTexture(GL_TEXTURE_2D, map->spritesheet.id);
+    
+    // Painter's order doesn't apply here, the depth buffer and back-face
+    // culling resolve visibility instead. Visible faces wind clockwise once
+    // the y axis is flipped into NDC.
+    glEnable(GL_DEPTH_TEST);
+    glDepthFunc(GL_LESS);
+    glEnable(GL_CULL_FACE);
+    glFrontFace(GL_CW);
+    glCullFace(GL_BACK);
+    
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, stream.ibo);
+    glEnableClientState(GL_VERTEX_ARRAY);
+    glEnableClientState(GL_TEXTURE_COORD_ARRAY);
+    map->residentFrame++;
+    int cy0 = region->y / MAP_CHUNK_SIZE, cy1 = (region->y + region->h - 1) / MAP_CHUNK_SIZE;
+    for (int cy = cy0; cy <= cy1 && region->w > 0 && region->h > 0; cy++) {
+        // Only the chunks the rows of this chunk row reach into
+        int x0 = region->x + region->w, x1 = region->x;
+        int y0 = MAX(cy * MAP_CHUNK_SIZE, region->y) - region->y;
+        int y1 = MIN((cy + 1) * MAP_CHUNK_SIZE, region->y + region->h) - region->y;
+        for (int y = y0; y < y1; y++)
+            if (region->rowBegin[y] < region->rowEnd[y]) {
+                x0 = MIN(x0, region->rowBegin[y]);
+                x1 = MAX(x1, region->rowEnd[y]);
+            }
+        int cx0 = x0 / MAP_CHUNK_SIZE, cx1 = (x1 - 1) / MAP_CHUNK_SIZE;
+        for (int cx = cx0; cx <= cx1 && x0 < x1; cx++) {
+            MapChunk *chunk = &map->chunks[cy * map->chunksW + cx];
+            chunk->drawn = map->residentFrame;
+            if (chunk->dirty)
+                BuildResidentChunk(map, cx, cy);
+            glBindBuffer(GL_ARRAY_BUFFER, chunk->geometry);
+            glVertexPointer(3, GL_FLOAT, sizeof(TileVertex), (void*)offsetof(TileVertex, x));
+            glTexCoordPointer(2, GL_FLOAT, sizeof(TileVertex), (void*)offsetof(TileVertex, s));
+            glDrawElements(GL_TRIANGLES, (GLsizei)chunk->sizeOfGeometry * 6, GL_UNSIGNED_INT, NULL);
+        }
+    }
+    glDisableClientState(GL_TEXTURE_COORD_ARRAY);
+    glDisableClientState(GL_VERTEX_ARRAY);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    EvictResidentChunks(map);
+    
+    glDisable(GL_CULL_FACE);
+    glDisable(GL_DEPTH_TEST);
+    glUseProgram(0);
+    // The map's depth is in its own space, don't let it clip later draws
+    glClear(GL_DEPTH_BUFFER_BIT);
+    return 1;
+}
+
+static void DrawCursor(Map *map, Projection *projection, int vw, int vh, int visible[6], Vec2i cursor) {
+    if (cursor.x < 0 || cursor.y < 0 || cursor.x >= map->w || cursor.y >= map->h)
+        return;
+    Tile *tile = &map->tiles[TileIndex(map, cursor.x, cursor.y)];
+    Vec2f points[8];
+    for (int i = 0; i < 8; i++) {
+        Vec3f p = ProjectPoint(projection, CUBE_POINTS.points[i] + Vec3New(cursor.x, 0.f, cursor.y));
+        points[i] = Vec2New((p.x / (float)vw) * 2.f - 1.f,
+                            ((p.y / (float)vh) * 2.f - 1.f) * -1.f);
+    }
+    glLineWidth(4.f);
+    glDisable(GL_TEXTURE_2D);
+    glColor4f(1.f, 0.f, 0.f, 1.f);
+    glBegin(GL_LINES);
+    int first = tile->solid ? NORTH_FACE : FLOOR_FACE;
+    int last = tile->solid ? CEILING_FACE : FLOOR_FACE;
+    for (int i = first; i <= last; i++)
+        if (visible[i] && !(tile->neighbors & (1 << i)))
+            for (int j = 0; j < 4; j++) {
+                glVertex2f(points[faces[i][j]].x, points[faces[i][j]].y);
+                glVertex2f(points[faces[i][(j + 1) & 3]].x, points[faces[i][(j + 1) & 3]].y);
+            }
+    glEnd();
 }
 
 static int CheckNormal(Cube *cube, int a, int b, int c) {
@@ -108,89 +956,361 @@ static int CheckNormal(Cube *cube, int a, int b, int c) {
     return Vec2Cross(vb - va, vc - va) > 0;
 }
 
-static Tile DefaultTile(int x, int y, int solid) {
-    return (Tile) {
-        .x = x,
-        .y = y,
-        .solid = solid,
-        .faces = {
-            [FLOOR_FACE]   = (Vec2i){ 0,  0 },
-            [NORTH_FACE]   = (Vec2i){ 9,  0 },
-            [EAST_FACE]    = (Vec2i){ 9,  0 },
-            [SOUTH_FACE]   = (Vec2i){ 9,  0 },
-            [WEST_FACE]    = (Vec2i){ 9,  0 },
-            [CEILING_FACE] = (Vec2i){ 11, 1 }
+// Grid step across each wall, and the wall it meets on the other side
+static const int neighborOffsets[6][2] = {
+    [NORTH_FACE] = {  0, -1 },
+    [EAST_FACE]  = {  0,  1 },
+    [SOUTH_FACE] = { -1,  0 },
+    [WEST_FACE]  = {  1,  0 }
+};
+
+static const TileFace oppositeFaces[6] = {
+    [FLOOR_FACE]   = CEILING_FACE,
+    [NORTH_FACE]   = EAST_FACE,
+    [EAST_FACE]    = NORTH_FACE,
+    [SOUTH_FACE]   = WEST_FACE,
+    [WEST_FACE]    = SOUTH_FACE,
+    [CEILING_FACE] = FLOOR_FACE
+};
+
+static void MarkChunkDirty(Map *map, int x, int y) {
+    map->chunks[(y / MAP_CHUNK_SIZE) * map->chunksW + x / MAP_CHUNK_SIZE].dirty = 1;
+}
+
+static inline int SpriteCount(Map *map) {
+    return map->columns * (map->spritesheet.height / 32);
+}
+
+// Indices past the end of the sheet would sample whatever lies beyond it
+static int CheckSprites(Map *map, const uint16_t sprites[6]) {
+    for (int i = 0; i < 6; i++)
+        if (sprites[i] >= SpriteCount(map)) {
+            printf("MAP ERROR: sprite %d is not in the spritesheet\n", sprites[i]);
+            return 0;
         }
-    };
+    return 1;
+}
+
+static void BuildTileType(Map *map, TileType *type, const uint16_t sprites[6]) {
+    memcpy(type->sprites, sprites, sizeof(type->sprites));
+    for (int i = 0; i < 6; i++)
+        SpriteUVs(map, sprites[i], type->uvs[i]);
+}
+
+static void ClearChunkJob(void *arg, int index) {
+    Map *map = arg;
+    Tile *tiles = map->tiles + (size_t)index * MAP_CHUNK_SIZE * MAP_CHUNK_SIZE;
+    Tile tile = { .solid = 0, .neighbors = 0, .type = 0 };
+    for (int i = 0; i < MAP_CHUNK_SIZE * MAP_CHUNK_SIZE; i++)
+        tiles[i] = tile;
 }
 
 void InitMap(Map *map, Texture *spritesheet, int w, int h) {
     memcpy(&map->spritesheet, spritesheet, sizeof(Texture));
-    map->tiles = malloc(sizeof(Tile) * w * h);
+    map->columns = spritesheet->width / 32;
+    // SpriteUVs divides by this, the sheet needs at least one whole sprite
+    assert(map->columns > 0 && spritesheet->height >= 32);
     map->w = w;
     map->h = h;
-    for (int x = 0; x < w; x++)
-        for (int y = 0; y < h; y++)
-            map->tiles[y * w + x] = DefaultTile(x, y, 0);
+    map->mode = MAP_RENDER_CPU;
+    map->meshing = 0;
+    map->revision = 1;
+    map->types = NULL;
+    map->sizeOfTypes = map->capacityOfTypes = 0;
+    uint16_t sprites[6] = {
+        [FLOOR_FACE]   = 0,
+        [NORTH_FACE]   = 9,
+        [EAST_FACE]    = 9,
+        [SOUTH_FACE]   = 9,
+        [WEST_FACE]    = 9,
+        [CEILING_FACE] = map->columns + 11
+    };
+    // Sheets smaller than the bundled one fall back to the first sprite
+    for (int i = 0; i < 6; i++)
+        if (sprites[i] >= SpriteCount(map))
+            sprites[i] = 0;
+    AddTileType(map, sprites);
+    map->chunksW = (w + MAP_CHUNK_SIZE - 1) / MAP_CHUNK_SIZE;
+    map->chunksH = (h + MAP_CHUNK_SIZE - 1) / MAP_CHUNK_SIZE;
+    map->chunks = calloc((size_t)map->chunksW * map->chunksH, sizeof(MapChunk));
+    map->residentChunks = NULL;
+    map->sizeOfResidentChunks = map->capacityOfResidentChunks = 0;
+    map->residentFrame = 0;
+    for (int i = 0; i < map->chunksW * map->chunksH; i++)
+        map->chunks[i].dirty = 1;
+    // Edge chunks are padded out to full size so every chunk is one block
+    size_t sizeOfTiles = (size_t)map->chunksW * map->chunksH * MAP_CHUNK_SIZE * MAP_CHUNK_SIZE;
+    map->tiles = malloc(sizeof(Tile) * sizeOfTiles);
+    assert(map->tiles);
+    // Chunks are contiguous blocks, each job clears one
+    ParallelFor(ClearChunkJob, map, map->chunksW * map->chunksH);
 }
 
 void DestroyMap(Map *map) {
-    if (map && map->tiles)
+    if (!map)
+        return;
+    if (map->tiles)
         free(map->tiles);
+    if (map->types)
+        free(map->types);
+    if (cache.map == map)
+        cache.valid = 0;
+    if (map->chunks) {
+        for (int i = 0; i < map->chunksW * map->chunksH; i++)
+            if (map->chunks[i].geometry)
+                glDeleteBuffers(1, &map->chunks[i].geometry);
+        free(map->chunks);
+    }
+    if (map->residentChunks)
+        free(map->residentChunks);
 }
 
-void RenderMap(Map *map, int vw, int vh, Camera *camera, Vec2i cursor) {
-    int visible[6];
-    memset(visible, 0, sizeof(int) * 6);
-    Cube cull;
-    CreateCube(0, 0, vw, vh, camera, cull.points);
-    for (int i = 0; i < 6; i++)
-        visible[i] = CheckNormal(&cull, faces[i][0], faces[i][1], faces[i][2]);
-    int inc = 0;
-    int count = 0;
-    for (int i = 1; i < 6; i++)
-        inc += visible[i];
-    for (int x = 0; x < 64; x++)
-        for (int y = 0; y < 64; y++)
-            count += map->tiles[y * 64 + x].solid ? inc : 1;
-    
-    Face *faces = malloc(sizeof(Face) * count);
-    memset(faces, 0, sizeof(Face) * count);
-    int n = 0;
-    for (int x = 0; x < 64; x++)
-        for (int y = 0; y < 64; y++)
-            GetCubeFaces(&map->tiles[y * 64 + x], vw, vh, camera, visible, faces, &n);
-    qsort(faces, count, sizeof(Face), SortFaces);
-    
-    for (int i = 0; i < count; i++) {
-        Face *currentFace = &faces[i];
+Tile* GetTile(Map *map, int x, int y) {
+    if (x < 0 || y < 0 || x >= map->w || y >= map->h)
+        return NULL;
+    return &map->tiles[TileIndex(map, x, y)];
+}
+
+void SetTile(Map *map, int x, int y, Tile tile) {
+    if (x < 0 || y < 0 || x >= map->w || y >= map->h)
+        return;
+    // Emitting would index past the palette, fall back to the default type
+    if (tile.type >= map->sizeOfTypes) {
+        printf("MAP ERROR: tile type %d is not in the palette\n", tile.type);
+        tile.type = 0;
+    }
+    // Keep the neighbour masks on both sides of every wall in sync, a wall
+    // between two solid tiles is never drawn
+    tile.neighbors = 0;
+    for (int i = NORTH_FACE; i <= WEST_FACE; i++) {
+        int nx = x + neighborOffsets[i][0];
+        int ny = y + neighborOffsets[i][1];
+        if (nx < 0 || ny < 0 || nx >= map->w || ny >= map->h)
+            continue;
+        Tile *neighbor = &map->tiles[TileIndex(map, nx, ny)];
+        int bit = 1 << oppositeFaces[i];
+        if (neighbor->solid)
+            tile.neighbors |= 1 << i;
+        neighbor->neighbors = tile.solid ? neighbor->neighbors | bit : neighbor->neighbors & ~bit;
+        MarkChunkDirty(map, nx, ny);
+    }
+    map->tiles[TileIndex(map, x, y)] = tile;
+    MarkChunkDirty(map, x, y);
+    map->revision++;
+}
+
+int AddTileType(Map *map, const uint16_t sprites[6]) {
+    if (map->sizeOfTypes == UINT16_MAX + 1) {
+        printf("MAP ERROR: tile type palette is full\n");
+        return -1;
+    }
+    if (!CheckSprites(map, sprites))
+        return -1;
+    if (map->sizeOfTypes == map->capacityOfTypes) {
+        map->capacityOfTypes = map->capacityOfTypes ? map->capacityOfTypes * 2 : 16;
+        map->types = realloc(map->types, sizeof(TileType) * map->capacityOfTypes);
+        assert(map->types);
+    }
+    BuildTileType(map, &map->types[map->sizeOfTypes], sprites);
+    return map->sizeOfTypes++;
+}
+
+void SetTileType(Map *map, int type, const uint16_t sprites[6]) {
+    if (type < 0 || type >= map->sizeOfTypes || !CheckSprites(map, sprites))
+        return;
+    BuildTileType(map, &map->types[type], sprites);
+    // Resident chunks bake UVs in, any of them could use this type
+    for (int i = 0; i < map->chunksW * map->chunksH; i++)
+        map->chunks[i].dirty = 1;
+    map->revision++;
+}
+
+// Regions smaller than this aren't worth waking the workers for
+#define MAP_PARALLEL_TILES 4096
+
+// Everything the jobs of one RenderMap call share. Face generation is split
+// into runs of the traversal's outer loop. Runs keep the painter's order
+// inside them and follow each other in it, so placing each run's faces
+// after the previous run's gives the same list a single thread would.
+typedef struct {
+    Map *map;
+    TileRegion region;
+    Traversal traversal;
+    Projection *projection;
+    PointArray world, screen;
+    Lattice lattice;
+    int *columnBegin, *columnEnd; // rows each column crosses, walking along x
+    int *visible;
+    int walls;
+    int meshed;
+    int outer, inner;
+    int rowsPerJob;
+    size_t pointsPerJob;
+    size_t *offsets; // faces per run, then where each run starts
+    Face *faces;
+    size_t sizeOfFaces, facesPerJob;
+    float *vertices;
+    int sizeOfVertex;
+    Vec2f invScreenSize;
+} MapJobs;
+
+// Map coordinate of the i-th line of the outer loop, and the stretch of the
+// inner axis it has in view. Walking columns, the rows in between can still
+// miss the column, InSpan tells.
+static inline int OuterSpan(MapJobs *jobs, int i, int *begin, int *end) {
+    TileRegion *region = &jobs->region;
+    if (jobs->traversal.outerX) {
+        int x = TraverseAxis(i, region->w, jobs->traversal.stepX);
+        *begin = jobs->columnBegin[x];
+        *end = jobs->columnEnd[x];
+        return region->x + x;
+    }
+    int y = TraverseAxis(i, region->h, jobs->traversal.stepY);
+    *begin = region->rowBegin[y];
+    *end = region->rowEnd[y];
+    return region->y + y;
+}
+
+static inline int InSpan(TileRegion *region, int x, int y) {
+    return x >= region->rowBegin[y - region->y] && x < region->rowEnd[y - region->y];
+}
+
+static void CountFacesJob(void *arg, int index) {
+    MapJobs *jobs = arg;
+    Map *map = jobs->map;
+    // Has to match GetCubeFaces exactly, runs are placed back to back.
+    // Meshing takes the floors and ceilings out of the traversal.
+    int walls = jobs->meshed ? jobs->walls & ~(1 << CEILING_FACE) : jobs->walls;
+    int floors = !jobs->meshed && jobs->visible[FLOOR_FACE];
+    size_t count = 0;
+    int end = MIN(jobs->outer, (index + 1) * jobs->rowsPerJob);
+    int outerX = jobs->traversal.outerX;
+    int innerStep = outerX ? jobs->traversal.stepY : jobs->traversal.stepX;
+    for (int i = index * jobs->rowsPerJob; i < end; i++) {
+        int first, last;
+        int outer = OuterSpan(jobs, i, &first, &last);
+        for (int j = 0; j < last - first; j++) {
+            // Same tiles in the same runs as GenerateFacesJob
+            int inner = innerStep > 0 ? first + j : last - 1 - j;
+            int x = outerX ? outer : inner, y = outerX ? inner : outer;
+            if (outerX && !InSpan(&jobs->region, x, y))
+                continue;
+            Tile *tile = &map->tiles[TileIndex(map, x, y)];
+            count += tile->solid ? __builtin_popcount(walls & ~tile->neighbors) : floors;
+        }
+    }
+    jobs->offsets[index] = count;
+}
+
+static void ProjectLatticeJob(void *arg, int index) {
+    MapJobs *jobs = arg;
+    Lattice *lattice = &jobs->lattice;
+    int rows = jobs->region.h + 1;
+    size_t sizeOfPoints = (size_t)lattice->layer * 2;
+    size_t begin = (size_t)index * jobs->pointsPerJob;
+    size_t end = MIN(sizeOfPoints, begin + jobs->pointsPerJob);
+    int row = begin < sizeOfPoints ? LatticeRow(lattice, rows, (uint32_t)(begin % lattice->layer)) : 0;
+    for (size_t p = begin; p < end; p++) {
+        uint32_t q = (uint32_t)(p < lattice->layer ? p : p - lattice->layer);
+        if (!q)
+            row = LatticeRow(lattice, rows, 0);
+        while (q >= lattice->base[row + 1])
+            row++;
+        jobs->world.x[p] = (float)(lattice->begin[row] + (int)(q - lattice->base[row]));
+        jobs->world.y[p] = p < lattice->layer ? 0.f : -1.f;
+        jobs->world.z[p] = (float)(jobs->region.y + row);
+    }
+    PointArray in = { jobs->world.x + begin, jobs->world.y + begin, jobs->world.z + begin };
+    PointArray out = { jobs->screen.x + begin, jobs->screen.y + begin, jobs->screen.z + begin };
+    ProjectPoints(jobs->projection, &in, &out, end - begin);
+}
+
+static void GenerateFacesJob(void *arg, int index) {
+    MapJobs *jobs = arg;
+    Map *map = jobs->map;
+    Traversal *traversal = &jobs->traversal;
+    size_t n = jobs->offsets[index];
+    int end = MIN(jobs->outer, (index + 1) * jobs->rowsPerJob);
+    int innerStep = traversal->outerX ? traversal->stepY : traversal->stepX;
+    uint32_t corners[8];
+    int cornersRow = -1;
+    for (int i = index * jobs->rowsPerJob; i < end; i++) {
+        int first, last;
+        int outer = OuterSpan(jobs, i, &first, &last);
+        for (int j = 0; j < last - first; j++) {
+            int inner = innerStep > 0 ? first + j : last - 1 - j;
+            int x = traversal->outerX ? outer : inner, y = traversal->outerX ? inner : outer;
+            if (traversal->outerX && !InSpan(&jobs->region, x, y))
+                continue;
+            int row = y - jobs->region.y;
+            if (row != cornersRow) {
+                LatticeCorners(&jobs->lattice, row, corners);
+                cornersRow = row;
+            }
+            Tile *tile = &map->tiles[TileIndex(map, x, y)];
+            GetCubeFaces(tile, x, y, LatticeIndex(&jobs->lattice, x, row), corners, jobs->visible, traversal->order, !jobs->meshed, jobs->faces, &n);
+        }
+    }
+}
+
+// Faces seen edge-on still get their four vertices, collapsed onto one
+// point, so every face's vertices sit at a fixed offset and runs can be
+// written independently
+static void EmitVerticesJob(void *arg, int index) {
+    MapJobs *jobs = arg;
+    Map *map = jobs->map;
+    PointArray *screen = &jobs->screen;
+    int meshed = jobs->meshed;
+    int sizeOfVertex = jobs->sizeOfVertex;
+    Vec2f vInvScreenSize = jobs->invScreenSize;
+    size_t begin = (size_t)index * jobs->facesPerJob;
+    size_t end = MIN(jobs->sizeOfFaces, begin + jobs->facesPerJob);
+    for (size_t i = begin; i < end; i++) {
+        Face *currentFace = &jobs->faces[i];
         Vec2f pos[4] = {
-            { currentFace->quad.points[0].x, currentFace->quad.points[0].y },
-            { currentFace->quad.points[1].x, currentFace->quad.points[1].y },
-            { currentFace->quad.points[2].x, currentFace->quad.points[2].y },
-            { currentFace->quad.points[3].x, currentFace->quad.points[3].y }
+            { screen->x[currentFace->points[0]], screen->y[currentFace->points[0]] },
+            { screen->x[currentFace->points[1]], screen->y[currentFace->points[1]] },
+            { screen->x[currentFace->points[2]], screen->y[currentFace->points[2]] },
+            { screen->x[currentFace->points[3]], screen->y[currentFace->points[3]] }
         };
         
-        Vec4f w = Vec4New(1.f, 1.f, 1.f, 1.f);
-        Vec2f center = Vec2Zero();
+        // Faces seen edge-on have collapsed diagonals, nothing to draw
         float rd = ((pos[2].x - pos[0].x) * (pos[3].y - pos[1].y) - (pos[3].x - pos[1].x) * (pos[2].y - pos[0].y));
         if (!rd)
-            continue;
+            pos[1] = pos[2] = pos[3] = pos[0];
         
-        Vec2f scale = Vec2New(1.f / (float)map->spritesheet.width,
-                              1.f / (float)map->spritesheet.height);
-        Vec2i offset = currentFace->tile->faces[currentFace->face] * 32;
-        Vec2f offsetf = Vec2New(offset.x, offset.y);
-        Vec2f uvtl = offsetf * scale;
-        Vec2f uvbr = uvtl + (Vec2New(32.f, 32.f) * scale);
-        Vec2f uvs[4] = {
-            { uvtl.x, uvtl.y },
-            { uvtl.x, uvbr.y },
-            { uvbr.x, uvbr.y },
-            { uvbr.x, uvtl.y }
-        };
-        Vec2f vInvScreenSize = Vec2New(1.f / (float)vw, 1.f / (float)vh);
+        Vec2f uvs[4];
+        TileType *type = &map->types[currentFace->type];
+        float sprite = 0.f;
+        if (meshed) {
+            // Tile-local coordinates, pulled in slightly so fract() never
+            // lands exactly on the next cell
+            Vec2f span = Vec2New((float)currentFace->spanX - 1e-3f, (float)currentFace->spanY - 1e-3f);
+            uvs[0] = Vec2New(1e-3f, 1e-3f);
+            uvs[1] = Vec2New(1e-3f, span.y);
+            uvs[2] = span;
+            uvs[3] = Vec2New(span.x, 1e-3f);
+            sprite = (float)type->sprites[currentFace->face];
+        } else
+            memcpy(uvs, type->uvs[currentFace->face], sizeof(uvs));
         
+        float *v = jobs->vertices + i * 4 * sizeOfVertex;
+        if (jobs->projection->affine || !rd) {
+            // Parallelograms interpolate correctly as they are, q is always 1
+            for (int j = 0; j < 4; j++, v += sizeOfVertex) {
+                v[0] = (pos[j].x * vInvScreenSize.x) * 2.f - 1.f;
+                v[1] = ((pos[j].y * vInvScreenSize.y) * 2.f - 1.f) * -1.f;
+                v[2] = uvs[j].x;
+                v[3] = uvs[j].y;
+                if (sizeOfVertex > 4)
+                    v[4] = sprite;
+                if (sizeOfVertex > 5)
+                    v[5] = 1.f;
+            }
+            continue;
+        }
+        
+        Vec2f center = Vec2Zero();
         rd = 1.0f / rd;
         float rn = ((pos[3].x - pos[1].x) * (pos[0].y - pos[1].y) - (pos[3].y - pos[1].y) * (pos[0].x - pos[1].x)) * rd;
         float sn = ((pos[2].x - pos[0].x) * (pos[0].y - pos[1].y) - (pos[2].y - pos[0].y) * (pos[0].x - pos[1].x)) * rd;
@@ -201,42 +1321,178 @@ void RenderMap(Map *map, int vw, int vh, Camera *camera, Vec2i cursor) {
         for (int j = 0; j < 4; j++)
             d[j] = Vec2Length(pos[j] - center);
         
-        for (int j = 0; j < 4; j++) {
+        for (int j = 0; j < 4; j++, v += sizeOfVertex) {
             float q = d[j] == 0.f ? 1.f : (d[j] + d[(j + 2) & 3]) / d[(j + 2) & 3];
-            uvs[j] *= q;
-            w[j] *= q;
-            pos[j] = Vec2New((pos[j].x * vInvScreenSize.x) * 2.f - 1.f,
-                             ((pos[j].y * vInvScreenSize.y) * 2.f - 1.f) * -1.f);
+            v[0] = (pos[j].x * vInvScreenSize.x) * 2.f - 1.f;
+            v[1] = ((pos[j].y * vInvScreenSize.y) * 2.f - 1.f) * -1.f;
+            v[2] = uvs[j].x * q;
+            v[3] = uvs[j].y * q;
+            v[4] = sprite * q;
+            v[5] = q;
         }
-        
-        glEnable(GL_TEXTURE_2D);
-        glEnable(GL_BLEND);
-        glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
-        
-        glBindTexture(GL_TEXTURE_2D, map->spritesheet.id);
-        glBegin(GL_TRIANGLE_FAN);
-        for (uint32_t n = 0; n < 4; n++) {
-            glColor4f(1.f, 1.f, 1.f, 1.f);
-            glTexCoord4f(uvs[n].x, uvs[n].y, 0.f, w[n]);
-            glVertex2f(pos[n].x, pos[n].y);
-            
+    }
+}
+
+void RenderMap(Map *map, int vw, int vh, Camera *camera, Vec2i cursor) {
+    int visible[6];
+    memset(visible, 0, sizeof(int) * 6);
+    Cube cull;
+    CreateCube(0, 0, vw, vh, camera, cull.points);
+    for (int i = 0; i < 6; i++)
+        visible[i] = CheckNormal(&cull, faces[i][0], faces[i][1], faces[i][2]);
+    Projection projection;
+    MakeProjection(vw, vh, camera, &projection);
+    // Only tiles that can land on screen are visited, so per-frame cost
+    // follows the number of tiles in view rather than the map size
+    TileRegion region;
+    VisibleRegion(map, &projection, vw, vh, &region);
+    // Camera is looking past the edge of the map, nothing to stream
+    if (region.w <= 0 || region.h <= 0 || !region.tiles) {
+        DrawCursor(map, &projection, vw, vh, visible, cursor);
+        return;
+    }
+    if (map->mode == MAP_RENDER_GPU && RenderResidentMap(map, vw, vh, &projection, &region)) {
+        DrawCursor(map, &projection, vw, vh, visible, cursor);
+        return;
+    }
+    int meshed = map->meshing && LoadTiledProgram();
+    if (CacheMatches(map, vw, vh, camera, meshed)) {
+        DrawMapStream(map, cache.quads, cache.meshed, cache.sizeOfTexCoord);
+        DrawCursor(map, &projection, vw, vh, visible, cursor);
+        return;
+    }
+    
+    MapJobs jobs = {
+        .map = map,
+        .region = region,
+        .projection = &projection,
+        .visible = visible,
+        .meshed = meshed
+    };
+    for (int i = 1; i < 6; i++)
+        if (visible[i])
+            jobs.walls |= 1 << i;
+    // Faces come out of the traversal already in back-to-front order
+    MakeTraversal(camera, &jobs.traversal);
+    jobs.outer = jobs.traversal.outerX ? region.w : region.h;
+    jobs.inner = jobs.traversal.outerX ? region.h : region.w;
+    size_t tiles = region.tiles;
+    int threads = tiles < MAP_PARALLEL_TILES ? 1 : JobThreads();
+    // A few runs per thread so an uneven split still balances out
+    int count = MAX(1, MIN(jobs.outer, threads * 4));
+    jobs.rowsPerJob = (jobs.outer + count - 1) / MAX(count, 1);
+    count = jobs.rowsPerJob ? (jobs.outer + jobs.rowsPerJob - 1) / jobs.rowsPerJob : 0;
+    scratch.offsets = GrowBuffer(scratch.offsets, &scratch.sizeOfOffsets, count + 1, sizeof(size_t));
+    jobs.offsets = scratch.offsets;
+    
+    if (jobs.traversal.outerX) {
+        scratch.columnBegin = GrowBuffer(scratch.columnBegin, &scratch.sizeOfColumnBegin, MAX(region.w, 1), sizeof(int));
+        scratch.columnEnd = GrowBuffer(scratch.columnEnd, &scratch.sizeOfColumnEnd, MAX(region.w, 1), sizeof(int));
+        jobs.columnBegin = scratch.columnBegin;
+        jobs.columnEnd = scratch.columnEnd;
+        for (int x = 0; x < region.w; x++) {
+            jobs.columnBegin[x] = region.y + region.h;
+            jobs.columnEnd[x] = region.y;
         }
-        glEnd();
-        
-        if (currentFace->tile->x == cursor.x && currentFace->tile->y == cursor.y) {
-            glLineWidth(4.f);
-            glDisable(GL_TEXTURE_2D);
-            glBegin(GL_LINES);
-            for (uint32_t n = 0; n < 4; n++) {
-                glColor4f(1.f, 0.f, 0.f, 1.f);
-                glVertex2f(pos[n].x, pos[n].y);
-                int j = n + 1;
-                if (j == 4)
-                    j = 0;
-                glVertex2f(pos[j].x, pos[j].y);
+        for (int y = 0; y < region.h; y++)
+            for (int x = region.rowBegin[y]; x < region.rowEnd[y]; x++) {
+                jobs.columnBegin[x - region.x] = MIN(jobs.columnBegin[x - region.x], region.y + y);
+                jobs.columnEnd[x - region.x] = region.y + y + 1;
             }
-            glEnd();
-        }
+        for (int x = 0; x < region.w; x++)
+            jobs.columnEnd[x] = MAX(jobs.columnEnd[x], jobs.columnBegin[x]);
+    }
+    
+    // Neighbouring tiles share corners, so instead of projecting eight points
+    // per tile, project a lattice of floor and ceiling vertices over the
+    // visible rows once and let the faces index into it
+    Lattice *lattice = &jobs.lattice;
+    scratch.latticeBegin = GrowBuffer(scratch.latticeBegin, &scratch.sizeOfLatticeBegin, region.h + 1, sizeof(int));
+    scratch.latticeBase = GrowBuffer(scratch.latticeBase, &scratch.sizeOfLatticeBase, region.h + 2, sizeof(uint32_t));
+    lattice->begin = scratch.latticeBegin;
+    lattice->base = scratch.latticeBase;
+    lattice->base[0] = 0;
+    for (int row = 0; row <= region.h; row++) {
+        int first = region.x + region.w, last = region.x - 1;
+        for (int y = MAX(row - 1, 0); y <= MIN(row, region.h - 1); y++)
+            if (region.rowBegin[y] < region.rowEnd[y]) {
+                first = MIN(first, region.rowBegin[y]);
+                last = MAX(last, region.rowEnd[y]);
+            }
+        lattice->begin[row] = first <= last ? first : region.x;
+        lattice->base[row + 1] = lattice->base[row] + (first <= last ? (uint32_t)(last - first + 1) : 0);
     }
-    free(faces);
+    lattice->layer = lattice->base[region.h + 1];
+    size_t sizeOfPoints = (size_t)lattice->layer * 2;
+    scratch.points = GrowBuffer(scratch.points, &scratch.sizeOfPoints, sizeOfPoints * 6, sizeof(float));
+    float *buffer = scratch.points;
+    jobs.world = (PointArray) {
+        .x = buffer,
+        .y = buffer + sizeOfPoints,
+        .z = buffer + sizeOfPoints * 2
+    };
+    jobs.screen = (PointArray) {
+        .x = buffer + sizeOfPoints * 3,
+        .y = buffer + sizeOfPoints * 4,
+        .z = buffer + sizeOfPoints * 5
+    };
+    // Keep runs a multiple of 8 so the SIMD kernels only see a tail at the end
+    jobs.pointsPerJob = MAX(((sizeOfPoints + threads - 1) / threads + 7) & ~(size_t)7, 8);
+    int projections = (int)((sizeOfPoints + jobs.pointsPerJob - 1) / jobs.pointsPerJob);
+    
+    // Counting and projecting don't touch each other's data, both go out at
+    // once and only generation has to wait for them
+    JobCounter ready = {0};
+    for (int i = 0; i < count; i++)
+        RunJob(CountFacesJob, &jobs, i, &ready);
+    for (int i = 0; i < projections; i++)
+        RunJob(ProjectLatticeJob, &jobs, i, &ready);
+    WaitForCounter(&ready);
+    
+    // Merged floors and ceilings can't outnumber the tiles
+    size_t n = 0, capacity = meshed ? tiles : 0;
+    for (int i = 0; i < count; i++)
+        capacity += jobs.offsets[i];
+    scratch.faces = GrowBuffer(scratch.faces, &scratch.sizeOfFaces, capacity, sizeof(Face));
+    Face *faces = jobs.faces = scratch.faces;
+    if (meshed && visible[FLOOR_FACE])
+        MeshFlatFaces(map, &region, lattice, FLOOR_FACE, faces, &n);
+    for (int i = 0; i < count; i++) {
+        size_t run = jobs.offsets[i];
+        jobs.offsets[i] = n;
+        n += run;
+    }
+    ParallelFor(GenerateFacesJob, &jobs, count);
+    if (meshed && visible[CEILING_FACE])
+        MeshFlatFaces(map, &region, lattice, CEILING_FACE, faces, &n);
+#if defined(MAP_VALIDATE_ORDER)
+    // neighbouring cells are at most two rows of the inner loop apart
+    ValidateFaceOrder(faces, &jobs.screen, n, (size_t)jobs.inner * 6 * 2);
+#endif
+    
+    // Every face is written straight into the streaming buffer, then the
+    // whole map goes out in a single draw call
+    int sizeOfTexCoord = MapTexCoordSize(projection.affine, meshed);
+    jobs.sizeOfVertex = 2 + sizeOfTexCoord;
+    jobs.vertices = BeginMapStream(n, sizeof(float) * jobs.sizeOfVertex);
+    cache.valid = 0;
+    if (!jobs.vertices)
+        return;
+    jobs.invScreenSize = Vec2New(1.f / (float)vw, 1.f / (float)vh);
+    jobs.sizeOfFaces = n;
+    jobs.facesPerJob = MAX(1, (n + count - 1) / MAX(count, 1));
+    ParallelFor(EmitVerticesJob, &jobs, (int)((n + jobs.facesPerJob - 1) / jobs.facesPerJob));
+    if (!EndMapStream())
+        return;
+    cache.map = map;
+    cache.camera = *camera;
+    cache.vw = vw;
+    cache.vh = vh;
+    cache.revision = map->revision;
+    cache.meshed = meshed;
+    cache.quads = n;
+    cache.sizeOfTexCoord = sizeOfTexCoord;
+    cache.valid = 1;
+    DrawMapStream(map, n, meshed, sizeOfTexCoord);
+    DrawCursor(map, &projection, vw, vh, visible, cursor);
 }
@@ -9,15 +9,14 @@
 #define map_h
 #include "common.h"
 
+// A tile's coordinates come from where it's stored, see GetTile. What it
+// looks like comes from its entry in the map's TileType palette.
 typedef struct {
-    int x, y, solid;
-    Vec2i faces[6];
+    uint16_t solid : 1;
+    uint16_t neighbors : 6; // bit per TileFace, set when the tile across that wall is solid
+    uint16_t type;
 } Tile;
 
-typedef struct {
-    Vec3f points[4];
-} Quad;
-
 typedef struct {
     Vec3f points[8];
 } Cube;
@@ -31,20 +30,73 @@ typedef enum {
     CEILING_FACE = 5
 } TileFace;
 
+// Sprites are indices into the spritesheet, row * columns + column. The atlas
+// UVs for each face are worked out once, when the type is added or changed.
+typedef struct {
+    uint16_t sprites[6];
+    Vec2f uvs[6][4];
+} TileType;
+
 typedef struct Face {
-    Quad quad;
-    Tile *tile;
+    uint32_t points[4];
+    int x, y;
     TileFace face;
+    uint16_t type;
+    uint16_t spanX, spanY; // tiles covered by a merged floor/ceiling
 } Face;
 
+typedef struct {
+    float m[3][3];
+    float t[3];
+    int affine; // no perspective divide, every quad stays a parallelogram
+} Projection;
+
+typedef struct {
+    float *x, *y, *z;
+} PointArray;
+
+typedef enum {
+    MAP_RENDER_CPU = 0,
+    MAP_RENDER_GPU
+} MapRenderMode;
+
+// Tiles are stored a chunk at a time, Z-order inside each chunk
+#define MAP_CHUNK_SHIFT 6
+#define MAP_CHUNK_SIZE (1 << MAP_CHUNK_SHIFT)
+
+typedef struct {
+    GLuint geometry;
+    size_t sizeOfGeometry;
+    int dirty;
+    unsigned int drawn; // resident frame it was last drawn on
+} MapChunk;
+
 typedef struct {
     Tile *tiles;
+    TileType *types;
+    int sizeOfTypes, capacityOfTypes;
     Texture spritesheet;
+    int columns;
     int w, h;
+    MapRenderMode mode;
+    int meshing;
+    MapChunk *chunks;
+    int chunksW, chunksH;
+    // Chunks holding a VBO, each is freed once it goes unseen for long enough
+    int *residentChunks;
+    size_t sizeOfResidentChunks, capacityOfResidentChunks;
+    unsigned int residentFrame;
+    unsigned int revision;
 } Map;
 
 void InitMap(Map *map, Texture *spritesheet, int w, int h);
 void DestroyMap(Map *map);
+Tile* GetTile(Map *map, int x, int y);
+void SetTile(Map *map, int x, int y, Tile tile);
+int AddTileType(Map *map, const uint16_t sprites[6]);
+void SetTileType(Map *map, int type, const uint16_t sprites[6]);
+void MakeProjection(int vw, int vh, Camera *camera, Projection *out);
+void ProjectPoints(Projection *projection, PointArray *in, PointArray *out, size_t length);
 void ProjectToMap(int tx, int ty, int vw, int vh, Camera *camera, Vec3f *in, Vec3f *out, size_t length);
 void RenderMap(Map *map,  int vw, int vh, Camera *camera, Vec2i cursor);
 
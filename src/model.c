@@ -6,23 +6,435 @@
 //
 
 #include "model.h"
-#define FAST_OBJ_IMPLEMENTATION
-#include "fast_obj.h"
+#include <sys/stat.h>
+#include <limits.h>
+#include "alloc_debug.h"
 
-void LoadModelObj(const char *path, Model *out) {
-    Mesh *mesh = out->meshes = malloc(sizeof(Mesh));
-    out->sizeOfMeshes = 1;
-    mesh->texture = NULL;
-    out->position = Vec3Zero();
-    out->scale = Vec3New(1.f, 1.f, 1.f);
-    out->rotation = Vec3Zero();
-    fastObjMesh* obj = fast_obj_read(path);
-    assert(obj);
+// Vertices expanded per job once the unique ones are known
+#define MODEL_VERTICES_PER_JOB 4096
+// Post-transform cache the triangle order is tuned for
+#define MODEL_VERTEX_CACHE_SIZE 16
+
+// Smallest piece of an OBJ worth its own parse job
+#define OBJ_CHUNK_SIZE (1 << 20)
+
+// One line-aligned piece of the file, parsed into arrays of its own. Corners
+// with relative indices can't be resolved until the records before this
+// piece are counted, so they are kept relative to its start until then.
+typedef struct {
+    const char *begin, *end;
+    float *positions, *texcoords, *normals;
+    size_t sizeOfPositions, sizeOfTexcoords, sizeOfNormals; // floats
+    size_t capacityOfPositions, capacityOfTexcoords, capacityOfNormals;
+    int32_t *corners; // p, t, n
+    uint8_t *relative; // a bit each for p, t and n
+    size_t sizeOfCorners, capacityOfCorners, capacityOfRelative;
+    uint32_t *faces;
+    size_t sizeOfFaces, capacityOfFaces;
+    // Records in the file before this piece
+    size_t firstPosition, firstTexcoord, firstNormal, firstCorner, firstFace;
+} ObjChunk;
+
+typedef struct {
+    ObjChunk *chunks;
+    ObjData *out;
+} ObjJobs;
+
+static inline int IsDigit(char c) {
+    return c >= '0' && c <= '9';
+}
+
+static inline const char* SkipSpaces(const char *p, const char *end) {
+    while (p < end && (*p == ' ' || *p == '\t'))
+        p++;
+    return p;
+}
+
+static double Power10(int e) {
+    static const double table[] = {
+        1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+        1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+    };
+    return e < sizeof(table) / sizeof(double) ? table[e] : pow(10.0, e);
+}
+
+// Digits go into an integer and get scaled once at the end, rather than
+// a double multiply per digit
+static const char* ParseObjFloat(const char *p, const char *end, float *out) {
+    p = SkipSpaces(p, end);
+    int negative = p < end && *p == '-';
+    if (p < end && (*p == '-' || *p == '+'))
+        p++;
+    uint64_t mantissa = 0;
+    int scale = 0;
+    for (; p < end && IsDigit(*p); p++)
+        if (mantissa < 100000000000000000ull)
+            mantissa = mantissa * 10 + (uint64_t)(*p - '0');
+        else
+            scale++;
+    if (p < end && *p == '.')
+        for (p++; p < end && IsDigit(*p); p++)
+            if (mantissa < 100000000000000000ull) {
+                mantissa = mantissa * 10 + (uint64_t)(*p - '0');
+                scale--;
+            }
+    if (p < end && (*p == 'e' || *p == 'E')) {
+        p++;
+        int sign = p < end && *p == '-' ? -1 : 1;
+        if (p < end && (*p == '-' || *p == '+'))
+            p++;
+        int exponent = 0;
+        for (; p < end && IsDigit(*p); p++)
+            exponent = MIN(exponent * 10 + (*p - '0'), 1000);
+        scale += sign * exponent;
+    }
+    double value = (double)mantissa;
+    if (scale)
+        value = scale > 0 ? value * Power10(scale) : value / Power10(-scale);
+    *out = (float)(negative ? -value : value);
+    return p;
+}
+
+static const char* ParseObjInt(const char *p, const char *end, int *out) {
+    int negative = p < end && *p == '-';
+    if (negative)
+        p++;
+    int value = 0;
+    for (; p < end && IsDigit(*p); p++)
+        value = value * 10 + (*p - '0');
+    *out = negative ? -value : value;
+    return p;
+}
+
+static void ParseObjFloats(const char *p, const char *end, int count, float **array, size_t *size, size_t *capacity) {
+    *array = GrowBuffer(*array, capacity, *size + count, sizeof(float));
+    for (int i = 0; i < count; i++)
+        p = ParseObjFloat(p, end, *array + (*size)++);
+}
+
+static void ParseObjFace(ObjChunk *chunk, const char *p, const char *end) {
+    uint32_t count = 0;
+    // Attributes this piece has seen so far, relative indices count back from here
+    int32_t seen[3] = {
+        (int32_t)(chunk->sizeOfPositions / 3),
+        (int32_t)(chunk->sizeOfTexcoords / 2),
+        (int32_t)(chunk->sizeOfNormals / 3)
+    };
+    for (p = SkipSpaces(p, end); p < end; p = SkipSpaces(p, end)) {
+        const char *start = p;
+        int v[3] = { 0, 0, 0 };
+        p = ParseObjInt(p, end, &v[0]);
+        if (p < end && *p == '/') {
+            p++;
+            if (p < end && *p != '/')
+                p = ParseObjInt(p, end, &v[1]);
+            if (p < end && *p == '/')
+                p = ParseObjInt(p + 1, end, &v[2]);
+        }
+        if (p == start)
+            break;
+        chunk->corners = GrowBuffer(chunk->corners, &chunk->capacityOfCorners, (chunk->sizeOfCorners + 1) * 3, sizeof(int32_t));
+        chunk->relative = GrowBuffer(chunk->relative, &chunk->capacityOfRelative, chunk->sizeOfCorners + 1, sizeof(uint8_t));
+        uint8_t relative = 0;
+        for (int k = 0; k < 3; k++) {
+            // -1 is the last one seen, same as fast_obj
+            if (v[k] < 0) {
+                v[k] += seen[k] + 1;
+                relative |= 1 << k;
+            }
+            chunk->corners[chunk->sizeOfCorners * 3 + k] = v[k];
+        }
+        chunk->relative[chunk->sizeOfCorners++] = relative;
+        count++;
+    }
+    chunk->faces = GrowBuffer(chunk->faces, &chunk->capacityOfFaces, chunk->sizeOfFaces + 1, sizeof(uint32_t));
+    chunk->faces[chunk->sizeOfFaces++] = count;
+}
+
+static void ParseObjChunkJob(void *arg, int index) {
+    ObjJobs *jobs = arg;
+    ObjChunk *chunk = &jobs->chunks[index];
+    const char *p = chunk->begin, *end = chunk->end;
+    while (p < end) {
+        const char *newline = memchr(p, '\n', end - p);
+        const char *eol = newline ? newline : end;
+        const char *line = SkipSpaces(p, eol);
+        p = newline ? newline + 1 : end;
+        if (eol > line && eol[-1] == '\r')
+            eol--;
+        if (eol - line < 2)
+            continue;
+        if (line[0] == 'v') {
+            if (line[1] == ' ' || line[1] == '\t')
+                ParseObjFloats(line + 1, eol, 3, &chunk->positions, &chunk->sizeOfPositions, &chunk->capacityOfPositions);
+            else if (line[1] == 't')
+                ParseObjFloats(line + 2, eol, 2, &chunk->texcoords, &chunk->sizeOfTexcoords, &chunk->capacityOfTexcoords);
+            else if (line[1] == 'n')
+                ParseObjFloats(line + 2, eol, 3, &chunk->normals, &chunk->sizeOfNormals, &chunk->capacityOfNormals);
+        } else if (line[0] == 'f' && (line[1] == ' ' || line[1] == '\t'))
+            ParseObjFace(chunk, line + 1, eol);
+    }
+}
+
+// Copies a piece into place and resolves its indices against everything
+// before it. Anything pointing outside the file falls back to the default.
+static void MergeObjChunkJob(void *arg, int index) {
+    ObjJobs *jobs = arg;
+    ObjChunk *chunk = &jobs->chunks[index];
+    ObjData *out = jobs->out;
+    memcpy(out->positions + 3 * (1 + chunk->firstPosition), chunk->positions, sizeof(float) * chunk->sizeOfPositions);
+    memcpy(out->texcoords + 2 * (1 + chunk->firstTexcoord), chunk->texcoords, sizeof(float) * chunk->sizeOfTexcoords);
+    memcpy(out->normals + 3 * (1 + chunk->firstNormal), chunk->normals, sizeof(float) * chunk->sizeOfNormals);
+    memcpy(out->faces + chunk->firstFace, chunk->faces, sizeof(uint32_t) * chunk->sizeOfFaces);
+    int64_t first[3] = { chunk->firstPosition, chunk->firstTexcoord, chunk->firstNormal };
+    int64_t limit[3] = { out->sizeOfPositions, out->sizeOfTexcoords, out->sizeOfNormals };
+    for (size_t i = 0; i < chunk->sizeOfCorners; i++) {
+        uint32_t resolved[3];
+        for (int k = 0; k < 3; k++) {
+            int64_t value = chunk->corners[i * 3 + k];
+            if (chunk->relative[i] & (1 << k))
+                value += first[k];
+            resolved[k] = value > 0 && value < limit[k] ? (uint32_t)value : 0;
+        }
+        out->indices[chunk->firstCorner + i] = (ObjIndex) {
+            .p = resolved[0],
+            .t = resolved[1],
+            .n = resolved[2]
+        };
+    }
+}
+
+static void FreeObjChunk(ObjChunk *chunk) {
+    free(chunk->positions);
+    free(chunk->texcoords);
+    free(chunk->normals);
+    free(chunk->corners);
+    free(chunk->relative);
+    free(chunk->faces);
+}
+
+int ParseObj(const char *path, ObjData *out) {
+    memset(out, 0, sizeof(ObjData));
+    size_t size = 0;
+    const char *data = MapFile(path, &size);
+    if (!data)
+        return 0;
+    // A few pieces per thread so uneven lines still balance out
+    size_t count = MAX(1, MIN((size_t)JobThreads() * 4, size / OBJ_CHUNK_SIZE));
+    ObjChunk *chunks = calloc(count, sizeof(ObjChunk));
+    assert(chunks);
+    const char *end = data + size;
+    for (size_t i = 0; i < count; i++) {
+        const char *begin = i ? chunks[i - 1].end : data;
+        const char *split = data + size * (i + 1) / count;
+        // Move the split forward to the start of the next line
+        if (split < end && split > begin && split[-1] != '\n') {
+            const char *newline = memchr(split, '\n', end - split);
+            split = newline ? newline + 1 : end;
+        }
+        chunks[i].begin = begin;
+        chunks[i].end = i == count - 1 ? end : MAX(split, begin);
+    }
+    ObjJobs jobs = {
+        .chunks = chunks,
+        .out = out
+    };
+    ParallelFor(ParseObjChunkJob, &jobs, (int)count);
     
-    mesh->sizeOfVertices = obj->face_count * 3;
-    mesh->vertices = malloc(obj->face_count * 3 * 8 * sizeof(float));
-    for (int i = 0; i < mesh->sizeOfVertices; i++) {
-        fastObjIndex vertex = obj->indices[i];
+    size_t positions = 0, texcoords = 0, normals = 0, corners = 0, faces = 0;
+    for (size_t i = 0; i < count; i++) {
+        chunks[i].firstPosition = positions;
+        chunks[i].firstTexcoord = texcoords;
+        chunks[i].firstNormal = normals;
+        chunks[i].firstCorner = corners;
+        chunks[i].firstFace = faces;
+        positions += chunks[i].sizeOfPositions / 3;
+        texcoords += chunks[i].sizeOfTexcoords / 2;
+        normals += chunks[i].sizeOfNormals / 3;
+        corners += chunks[i].sizeOfCorners;
+        faces += chunks[i].sizeOfFaces;
+    }
+    out->sizeOfPositions = (uint32_t)positions + 1;
+    out->sizeOfTexcoords = (uint32_t)texcoords + 1;
+    out->sizeOfNormals = (uint32_t)normals + 1;
+    out->sizeOfIndices = (uint32_t)corners;
+    out->sizeOfFaces = (uint32_t)faces;
+    out->positions = malloc(sizeof(float) * 3 * out->sizeOfPositions);
+    out->texcoords = malloc(sizeof(float) * 2 * out->sizeOfTexcoords);
+    out->normals = malloc(sizeof(float) * 3 * out->sizeOfNormals);
+    out->indices = malloc(sizeof(ObjIndex) * MAX(1, corners));
+    out->faces = malloc(sizeof(uint32_t) * MAX(1, faces));
+    assert(out->positions && out->texcoords && out->normals && out->indices && out->faces);
+    // The defaults, same as fast_obj's
+    memcpy(out->positions, (float[3]){ 0.f, 0.f, 0.f }, sizeof(float) * 3);
+    memcpy(out->texcoords, (float[2]){ 0.f, 0.f }, sizeof(float) * 2);
+    memcpy(out->normals, (float[3]){ 0.f, 0.f, 1.f }, sizeof(float) * 3);
+    ParallelFor(MergeObjChunkJob, &jobs, (int)count);
+    
+    for (size_t i = 0; i < count; i++)
+        FreeObjChunk(&chunks[i]);
+    free(chunks);
+    UnmapFile((void*)data, size);
+    return 1;
+}
+
+void FreeObjData(ObjData *obj) {
+    free(obj->positions);
+    free(obj->texcoords);
+    free(obj->normals);
+    free(obj->indices);
+    free(obj->faces);
+    memset(obj, 0, sizeof(ObjData));
+}
+
+// Every distinct (position, normal, texcoord) triple becomes one vertex,
+// triangles index into them. Returns the vertex count, unique[i] is where
+// vertex i first shows up in obj->indices.
+static int DeduplicateVertices(ObjData *obj, const uint32_t *corners, int sizeOfCorners, uint32_t *unique, uint32_t *indices) {
+    size_t sizeOfTable = 1;
+    while (sizeOfTable < (size_t)sizeOfCorners * 2)
+        sizeOfTable <<= 1;
+    // Holds vertex + 1, zero is empty
+    uint32_t *table = calloc(sizeOfTable, sizeof(uint32_t));
+    assert(table);
+    int sizeOfUnique = 0;
+    for (int i = 0; i < sizeOfCorners; i++) {
+        ObjIndex key = obj->indices[corners[i]];
+        size_t slot = ((key.p * 73856093u) ^ (key.t * 19349663u) ^ (key.n * 83492791u)) & (sizeOfTable - 1);
+        for (;;) {
+            if (!table[slot]) {
+                unique[sizeOfUnique] = corners[i];
+                table[slot] = ++sizeOfUnique;
+                indices[i] = sizeOfUnique - 1;
+                break;
+            }
+            ObjIndex other = obj->indices[unique[table[slot] - 1]];
+            if (other.p == key.p && other.t == key.t && other.n == key.n) {
+                indices[i] = table[slot] - 1;
+                break;
+            }
+            slot = (slot + 1) & (sizeOfTable - 1);
+        }
+    }
+    free(table);
+    return sizeOfUnique;
+}
+
+// Tipsify (Sander, Nehab & Barczak 2007). Fans out around one vertex at a
+// time, then moves to whichever vertex it just touched will still be in the
+// cache when its remaining triangles go out, falling back to a recently
+// used one and then to a scan when it hits a dead end.
+static void OptimizeVertexCache(uint32_t *indices, int sizeOfIndices, int sizeOfVertices) {
+    int triangles = sizeOfIndices / 3;
+    int *live = calloc(sizeOfVertices, sizeof(int));
+    int *offsets = malloc(sizeof(int) * (sizeOfVertices + 1));
+    int *adjacency = malloc(sizeof(int) * sizeOfIndices);
+    int *stamps = calloc(sizeOfVertices, sizeof(int));
+    int *deadEnds = malloc(sizeof(int) * sizeOfIndices);
+    uint8_t *emitted = calloc(triangles, sizeof(uint8_t));
+    uint32_t *out = malloc(sizeof(uint32_t) * sizeOfIndices);
+    assert(live && offsets && adjacency && stamps && deadEnds && emitted && out);
+    for (int i = 0; i < sizeOfIndices; i++)
+        live[indices[i]]++;
+    offsets[0] = 0;
+    for (int v = 0; v < sizeOfVertices; v++)
+        offsets[v + 1] = offsets[v] + live[v];
+    // stamps doubles as the fill cursor before the timestamps start
+    for (int t = 0; t < triangles; t++)
+        for (int j = 0; j < 3; j++) {
+            uint32_t v = indices[t * 3 + j];
+            adjacency[offsets[v] + stamps[v]++] = t;
+        }
+    memset(stamps, 0, sizeof(int) * sizeOfVertices);
+    
+    int time = MODEL_VERTEX_CACHE_SIZE + 1, cursor = 0, sizeOfDeadEnds = 0, n = 0;
+    int fanning = sizeOfVertices ? 0 : -1;
+    while (fanning >= 0) {
+        // Everything touched by this fan is a candidate for the next one
+        int candidates = sizeOfDeadEnds;
+        for (int a = offsets[fanning]; a < offsets[fanning + 1]; a++) {
+            int t = adjacency[a];
+            if (emitted[t])
+                continue;
+            for (int j = 0; j < 3; j++) {
+                uint32_t v = indices[t * 3 + j];
+                deadEnds[sizeOfDeadEnds++] = v;
+                live[v]--;
+                if (time - stamps[v] > MODEL_VERTEX_CACHE_SIZE)
+                    stamps[v] = time++;
+            }
+            emitted[t] = 1;
+            memcpy(out + n, indices + t * 3, sizeof(uint32_t) * 3);
+            n += 3;
+        }
+        
+        int best = -1, priority = -1;
+        for (int c = candidates; c < sizeOfDeadEnds; c++) {
+            int v = deadEnds[c];
+            if (!live[v])
+                continue;
+            int p = 0;
+            if (time - stamps[v] + 2 * live[v] <= MODEL_VERTEX_CACHE_SIZE)
+                p = time - stamps[v];
+            if (p > priority) {
+                priority = p;
+                best = v;
+            }
+        }
+        while (best < 0 && sizeOfDeadEnds) {
+            int v = deadEnds[--sizeOfDeadEnds];
+            if (live[v])
+                best = v;
+        }
+        for (; best < 0 && cursor < sizeOfVertices; cursor++)
+            if (live[cursor])
+                best = cursor;
+        fanning = best;
+    }
+    memcpy(indices, out, sizeof(uint32_t) * n);
+    free(live);
+    free(offsets);
+    free(adjacency);
+    free(stamps);
+    free(deadEnds);
+    free(emitted);
+    free(out);
+}
+
+// Renumbers vertices in the order the triangles first use them, so vertex
+// reads walk forward through memory
+static void OptimizeVertexFetch(uint32_t *indices, int sizeOfIndices, uint32_t *unique, int sizeOfVertices) {
+    uint32_t *remap = malloc(sizeof(uint32_t) * sizeOfVertices);
+    uint32_t *reordered = malloc(sizeof(uint32_t) * sizeOfVertices);
+    assert(remap && reordered);
+    memset(remap, 0xFF, sizeof(uint32_t) * sizeOfVertices);
+    uint32_t next = 0;
+    for (int i = 0; i < sizeOfIndices; i++) {
+        uint32_t v = indices[i];
+        if (remap[v] == UINT32_MAX) {
+            remap[v] = next;
+            reordered[next++] = unique[v];
+        }
+        indices[i] = remap[v];
+    }
+    memcpy(unique, reordered, sizeof(uint32_t) * next);
+    free(remap);
+    free(reordered);
+}
+
+typedef struct {
+    ObjData *obj;
+    const uint32_t *unique;
+    Mesh *mesh;
+} ExpandJobs;
+
+static void ExpandVerticesJob(void *arg, int index) {
+    ExpandJobs *jobs = arg;
+    ObjData *obj = jobs->obj;
+    Mesh *mesh = jobs->mesh;
+    int end = MIN(mesh->sizeOfVertices, (index + 1) * MODEL_VERTICES_PER_JOB);
+    for (int i = index * MODEL_VERTICES_PER_JOB; i < end; i++) {
+        ObjIndex vertex = obj->indices[jobs->unique[i]];
         unsigned int pos = i * 8;
         unsigned int v_pos = vertex.p * 3;
         unsigned int n_pos = vertex.n * 3;
@@ -33,7 +445,343 @@ void LoadModelObj(const char *path, Model *out) {
     }
 }
 
+static void InitModel(Model *out, int sizeOfMeshes) {
+    out->meshes = calloc(sizeOfMeshes, sizeof(Mesh));
+    assert(out->meshes);
+    out->sizeOfMeshes = sizeOfMeshes;
+    out->mapping = NULL;
+    out->sizeOfMapping = 0;
+    out->position = Vec3Zero();
+    out->scale = Vec3New(1.f, 1.f, 1.f);
+    out->rotation = Vec3Zero();
+}
+
+static void MeshBounds(Mesh *mesh) {
+    mesh->min = Vec3New(INFINITY, INFINITY, INFINITY);
+    mesh->max = Vec3New(-INFINITY, -INFINITY, -INFINITY);
+    for (int i = 0; i < mesh->sizeOfVertices; i++) {
+        float *v = mesh->vertices + i * 8;
+        mesh->min = Vec3New(MIN(mesh->min.x, v[0]), MIN(mesh->min.y, v[1]), MIN(mesh->min.z, v[2]));
+        mesh->max = Vec3New(MAX(mesh->max.x, v[0]), MAX(mesh->max.y, v[1]), MAX(mesh->max.z, v[2]));
+    }
+}
+
+void LoadModelObj(const char *path, Model *out) {
+    InitModel(out, 1);
+    Mesh *mesh = out->meshes;
+    ObjData data;
+    if (!ParseObj(path, &data)) {
+        printf("MODEL ERROR: failed to load \"%s\"\n", path);
+        abort();
+    }
+    ObjData *obj = &data;
+    
+    // Faces with more than three corners are split into fans
+    int sizeOfCorners = 0;
+    for (uint32_t i = 0; i < obj->sizeOfFaces; i++)
+        sizeOfCorners += obj->faces[i] >= 3 ? (obj->faces[i] - 2) * 3 : 0;
+    uint32_t *corners = malloc(sizeof(uint32_t) * sizeOfCorners);
+    uint32_t *unique = malloc(sizeof(uint32_t) * sizeOfCorners);
+    mesh->indices = malloc(sizeof(uint32_t) * sizeOfCorners);
+    assert(corners && unique && mesh->indices);
+    for (uint32_t i = 0, first = 0, n = 0; i < obj->sizeOfFaces; first += obj->faces[i++])
+        for (uint32_t j = 2; j < obj->faces[i]; j++) {
+            corners[n++] = first;
+            corners[n++] = first + j - 1;
+            corners[n++] = first + j;
+        }
+    mesh->sizeOfIndices = sizeOfCorners;
+    mesh->vbo = mesh->ibo = 0;
+    mesh->sizeOfVertices = DeduplicateVertices(obj, corners, sizeOfCorners, unique, mesh->indices);
+    free(corners);
+    OptimizeVertexCache(mesh->indices, mesh->sizeOfIndices, mesh->sizeOfVertices);
+    OptimizeVertexFetch(mesh->indices, mesh->sizeOfIndices, unique, mesh->sizeOfVertices);
+    
+    mesh->vertices = malloc(mesh->sizeOfVertices * 8 * sizeof(float));
+    assert(mesh->vertices);
+    ExpandJobs jobs = {
+        .obj = obj,
+        .unique = unique,
+        .mesh = mesh
+    };
+    ParallelFor(ExpandVerticesJob, &jobs, (mesh->sizeOfVertices + MODEL_VERTICES_PER_JOB - 1) / MODEL_VERTICES_PER_JOB);
+    free(unique);
+    FreeObjData(obj);
+    MeshBounds(mesh);
+}
+
+// .tbm layout: header, one TbmMesh per mesh, then each mesh's vertices and
+// indices exactly as they are uploaded, every stream starting on a
+// TBM_ALIGN boundary. Native endianness, a foreign file fails the magic.
+#define TBM_MAGIC 0x314D4254u // "TBM1"
+#define TBM_VERSION 2
+#define TBM_ALIGN 16
+
+typedef struct {
+    uint32_t magic, version;
+    uint64_t sizeOfFile;
+    // The OBJ this was built from, stat first and the hash when that differs.
+    // Copies can keep the mtime but not the inode and ctime, so all three count.
+    uint64_t sourceHash, sourceSize, sourceInode;
+    int64_t sourceTime, sourceChanged;
+    uint32_t sizeOfMeshes, sizeOfVertex;
+    float min[3], max[3];
+} TbmHeader;
+
+typedef struct {
+    uint64_t vertices, indices; // file offsets
+    uint32_t sizeOfVertices, sizeOfIndices;
+    float min[3], max[3];
+} TbmMesh;
+
+typedef struct {
+    uint64_t size, inode;
+    int64_t time, changed;
+    uint64_t hash;
+    int hashed;
+} ModelSource;
+
+// FNV-1a, 64 bit
+static uint64_t HashBytes(const uint8_t *data, size_t size) {
+    uint64_t hash = 0xcbf29ce484222325ull;
+    for (size_t i = 0; i < size; i++)
+        hash = (hash ^ data[i]) * 0x100000001b3ull;
+    return hash;
+}
+
+static uint64_t SourceHash(const char *path, ModelSource *source) {
+    if (!source->hashed) {
+        size_t size = 0;
+        uint8_t *data = MapFile(path, &size);
+        source->hash = HashBytes(data, data ? size : 0);
+        source->hashed = 1;
+        UnmapFile(data, size);
+    }
+    return source->hash;
+}
+
+static uint64_t AlignTbm(uint64_t offset) {
+    return (offset + TBM_ALIGN - 1) & ~(uint64_t)(TBM_ALIGN - 1);
+}
+
+static int ValidModelCache(uint8_t *data, size_t size, const char *cachePath, const char *path, ModelSource *source) {
+    TbmHeader header;
+    if (size < sizeof(TbmHeader))
+        return 0;
+    memcpy(&header, data, sizeof(TbmHeader));
+    if (header.magic != TBM_MAGIC || header.version != TBM_VERSION ||
+        header.sizeOfFile != size || header.sizeOfVertex != sizeof(float) * 8 ||
+        sizeof(TbmHeader) + (uint64_t)header.sizeOfMeshes * sizeof(TbmMesh) > size)
+        return 0;
+    TbmMesh *table = (TbmMesh*)(data + sizeof(TbmHeader));
+    // Offsets are checked before adding to them, a huge one would wrap. Index
+    // values were range checked before the cache was written, so a hit only
+    // ever reads the header and table.
+    for (uint32_t i = 0; i < header.sizeOfMeshes; i++)
+        if (table[i].vertices % TBM_ALIGN || table[i].indices % TBM_ALIGN ||
+            table[i].vertices > size || table[i].indices > size ||
+            (uint64_t)table[i].sizeOfVertices * header.sizeOfVertex > size - table[i].vertices ||
+            (uint64_t)table[i].sizeOfIndices * sizeof(uint32_t) > size - table[i].indices ||
+            table[i].sizeOfVertices > INT_MAX || table[i].sizeOfIndices > INT_MAX)
+            return 0;
+    // Without the OBJ there is nothing to compare against, use it as it is
+    if (!source)
+        return 1;
+    if (header.sourceSize == source->size && header.sourceTime == source->time &&
+        header.sourceInode == source->inode && header.sourceChanged == source->changed)
+        return 1;
+    // Touched but maybe not changed, only the contents decide
+    if (header.sourceSize != source->size || header.sourceHash != SourceHash(path, source))
+        return 0;
+    // Same contents, remember the new stat so the next load skips the hash
+    header.sourceTime = source->time;
+    header.sourceInode = source->inode;
+    header.sourceChanged = source->changed;
+    FILE *file = fopen(cachePath, "r+b");
+    if (file) {
+        fwrite(&header, sizeof(TbmHeader), 1, file);
+        fclose(file);
+    }
+    return 1;
+}
+
+static int LoadModelCache(const char *cachePath, const char *path, ModelSource *source, Model *out) {
+    size_t size = 0;
+    uint8_t *data = MapFile(cachePath, &size);
+    if (!data)
+        return 0;
+    if (!ValidModelCache(data, size, cachePath, path, source)) {
+        UnmapFile(data, size);
+        return 0;
+    }
+    // Meshes point straight into the mapping until they are uploaded
+    TbmHeader *header = (TbmHeader*)data;
+    TbmMesh *table = (TbmMesh*)(data + sizeof(TbmHeader));
+    InitModel(out, header->sizeOfMeshes);
+    out->mapping = data;
+    out->sizeOfMapping = size;
+    for (uint32_t i = 0; i < header->sizeOfMeshes; i++) {
+        Mesh *mesh = &out->meshes[i];
+        mesh->vertices = (float*)(data + table[i].vertices);
+        mesh->sizeOfVertices = table[i].sizeOfVertices;
+        mesh->indices = (uint32_t*)(data + table[i].indices);
+        mesh->sizeOfIndices = table[i].sizeOfIndices;
+        mesh->min = Vec3New(table[i].min[0], table[i].min[1], table[i].min[2]);
+        mesh->max = Vec3New(table[i].max[0], table[i].max[1], table[i].max[2]);
+    }
+    return 1;
+}
+
+static void WritePadding(FILE *file, uint64_t *offset, uint64_t target) {
+    static const uint8_t zeros[TBM_ALIGN] = {0};
+    fwrite(zeros, 1, target - *offset, file);
+    *offset = target;
+}
+
+static void WriteModelCache(const char *cachePath, const char *path, ModelSource *source, Model *model) {
+    // Checked once here so loads never have to scan them, GL would read
+    // past the vertex buffer for any of these
+    for (int i = 0; i < model->sizeOfMeshes; i++)
+        for (int j = 0; j < model->meshes[i].sizeOfIndices; j++)
+            if (model->meshes[i].indices[j] >= (uint32_t)model->meshes[i].sizeOfVertices) {
+                printf("MODEL ERROR: not caching \"%s\", index out of range\n", path);
+                return;
+            }
+    TbmHeader header = {
+        .magic = TBM_MAGIC,
+        .version = TBM_VERSION,
+        .sourceHash = SourceHash(path, source),
+        .sourceSize = source->size,
+        .sourceInode = source->inode,
+        .sourceTime = source->time,
+        .sourceChanged = source->changed,
+        .sizeOfMeshes = model->sizeOfMeshes,
+        .sizeOfVertex = sizeof(float) * 8,
+        .min = { INFINITY, INFINITY, INFINITY },
+        .max = { -INFINITY, -INFINITY, -INFINITY }
+    };
+    TbmMesh *table = calloc(model->sizeOfMeshes, sizeof(TbmMesh));
+    assert(table);
+    uint64_t offset = AlignTbm(sizeof(TbmHeader) + sizeof(TbmMesh) * model->sizeOfMeshes);
+    for (int i = 0; i < model->sizeOfMeshes; i++) {
+        Mesh *mesh = &model->meshes[i];
+        table[i] = (TbmMesh) {
+            .vertices = offset,
+            .indices = AlignTbm(offset + (uint64_t)mesh->sizeOfVertices * header.sizeOfVertex),
+            .sizeOfVertices = mesh->sizeOfVertices,
+            .sizeOfIndices = mesh->sizeOfIndices,
+            .min = { mesh->min.x, mesh->min.y, mesh->min.z },
+            .max = { mesh->max.x, mesh->max.y, mesh->max.z }
+        };
+        offset = AlignTbm(table[i].indices + (uint64_t)mesh->sizeOfIndices * sizeof(uint32_t));
+        for (int j = 0; j < 3; j++) {
+            header.min[j] = MIN(header.min[j], table[i].min[j]);
+            header.max[j] = MAX(header.max[j], table[i].max[j]);
+        }
+    }
+    header.sizeOfFile = offset;
+    
+    // Written beside the cache and renamed over it once complete, so a
+    // process with the old one mapped never sees it truncated and an
+    // interrupted write never leaves a half-written cache behind
+    char tempPath[FILENAME_MAX];
+    snprintf(tempPath, sizeof(tempPath), "%s.tmp", cachePath);
+    FILE *file = fopen(tempPath, "wb");
+    if (!file) {
+        printf("MODEL ERROR: can't write cache \"%s\"\n", tempPath);
+        free(table);
+        return;
+    }
+    fwrite(&header, sizeof(TbmHeader), 1, file);
+    fwrite(table, sizeof(TbmMesh), model->sizeOfMeshes, file);
+    offset = sizeof(TbmHeader) + sizeof(TbmMesh) * model->sizeOfMeshes;
+    for (int i = 0; i < model->sizeOfMeshes; i++) {
+        Mesh *mesh = &model->meshes[i];
+        WritePadding(file, &offset, table[i].vertices);
+        fwrite(mesh->vertices, header.sizeOfVertex, mesh->sizeOfVertices, file);
+        offset += (uint64_t)mesh->sizeOfVertices * header.sizeOfVertex;
+        WritePadding(file, &offset, table[i].indices);
+        fwrite(mesh->indices, sizeof(uint32_t), mesh->sizeOfIndices, file);
+        offset += (uint64_t)mesh->sizeOfIndices * sizeof(uint32_t);
+    }
+    WritePadding(file, &offset, header.sizeOfFile);
+    int failed = fflush(file) || ferror(file);
+    if (fclose(file) || failed || !RenameFile(tempPath, cachePath)) {
+        printf("MODEL ERROR: failed writing cache \"%s\"\n", cachePath);
+        remove(tempPath);
+    }
+    free(table);
+}
+
+// Nanoseconds where the platform has them, seconds miss quick edits
+static int64_t ModifiedTime(struct stat *info) {
+#if defined(PLATFORM_MAC)
+    return (int64_t)info->st_mtimespec.tv_sec * 1000000000ll + info->st_mtimespec.tv_nsec;
+#elif defined(PLATFORM_LINUX)
+    return (int64_t)info->st_mtim.tv_sec * 1000000000ll + info->st_mtim.tv_nsec;
+#else
+    return (int64_t)info->st_mtime * 1000000000ll;
+#endif
+}
+
+// Status change time, which nothing can set back (creation time on Windows)
+static int64_t ChangedTime(struct stat *info) {
+#if defined(PLATFORM_MAC)
+    return (int64_t)info->st_ctimespec.tv_sec * 1000000000ll + info->st_ctimespec.tv_nsec;
+#elif defined(PLATFORM_LINUX)
+    return (int64_t)info->st_ctim.tv_sec * 1000000000ll + info->st_ctim.tv_nsec;
+#else
+    return (int64_t)info->st_ctime * 1000000000ll;
+#endif
+}
+
+void LoadModel(const char *path, Model *out) {
+    char cachePath[FILENAME_MAX];
+    snprintf(cachePath, sizeof(cachePath), "%s.tbm", path);
+    struct stat info;
+    ModelSource source = {0};
+    int found = !stat(path, &info);
+    if (found) {
+        source.size = (uint64_t)info.st_size;
+        source.inode = (uint64_t)info.st_ino;
+        source.time = ModifiedTime(&info);
+        source.changed = ChangedTime(&info);
+    }
+    if (LoadModelCache(cachePath, path, found ? &source : NULL, out))
+        return;
+    LoadModelObj(path, out);
+    if (found)
+        WriteModelCache(cachePath, path, &source, out);
+}
+
+void UploadModel(Model *model) {
+    for (int i = 0; i < model->sizeOfMeshes; i++) {
+        Mesh *mesh = &model->meshes[i];
+        if (mesh->vbo)
+            continue;
+        glGenBuffers(1, &mesh->vbo);
+        glBindBuffer(GL_ARRAY_BUFFER, mesh->vbo);
+        glBufferData(GL_ARRAY_BUFFER, sizeof(float) * 8 * mesh->sizeOfVertices, mesh->vertices, GL_STATIC_DRAW);
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+        glGenBuffers(1, &mesh->ibo);
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mesh->ibo);
+        glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(uint32_t) * mesh->sizeOfIndices, mesh->indices, GL_STATIC_DRAW);
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+        // Only the GL copies are drawn from
+        if (!model->mapping) {
+            free(mesh->vertices);
+            free(mesh->indices);
+        }
+        mesh->vertices = NULL;
+        mesh->indices = NULL;
+    }
+    UnmapFile(model->mapping, model->sizeOfMapping);
+    model->mapping = NULL;
+}
+
 static void RenderMesh(Mesh *mesh, int tx, int ty, Camera *camera) {
+    if (!mesh->vbo)
+        return;
     if (mesh->texture) {
         glEnable(GL_TEXTURE_2D);
         glEnable(GL_BLEND);
@@ -59,29 +807,27 @@ static void RenderMesh(Mesh *mesh, int tx, int ty, Camera *camera) {
     glRotatef(adjustment.x, 1.0, 0.0, 0.0); // Rotate around the x-axis
     glRotatef(adjustment.y, 0.0, 1.0, 0.0); // Rotate around the y-axis
  
-    glBegin(GL_TRIANGLES);
-    size_t sz = mesh->sizeOfVertices;
-    Vec3f positions[sz], normals[sz];
-    Vec2f texcoords[sz];
-    for (int i = 0; i < mesh->sizeOfVertices; i += 3) {
-        for (int j = 0; j < 3; ++j) {
-            float *vertex = mesh->vertices + ((i + j) * 8);
-            memcpy(positions + i + j, vertex, sizeof(float) * 3);
-            memcpy(normals + i + j, vertex + 3, sizeof(float) * 3);
-            memcpy(texcoords + i + j, vertex + 6, sizeof(float) * 2);
-            Vec3f position = Vec3New(vertex[0], vertex[1], vertex[2]);
-            Vec3f normal   = Vec3New(vertex[3], vertex[4], vertex[5]);
-            Vec2f texcoord = Vec2New(vertex[6], vertex[7]);
-
-            if (mesh->texture)
-                glTexCoord2f(texcoord.x, texcoord.y);
-            else
-                glColor4f(1.f, 0.f, 1.f, 1.f);
-            glNormal3f(normal.x, normal.y, normal.z);
-            glVertex3f(position.x, position.y, position.z);
-        }
-    }
-    glEnd();
+    // Fixed function arrays, there are no VAOs in GL 2.1 so the pointers
+    // are set per draw, which costs the same whatever the triangle count
+    GLsizei stride = sizeof(float) * 8;
+    glBindBuffer(GL_ARRAY_BUFFER, mesh->vbo);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mesh->ibo);
+    glEnableClientState(GL_VERTEX_ARRAY);
+    glEnableClientState(GL_NORMAL_ARRAY);
+    glVertexPointer(3, GL_FLOAT, stride, NULL);
+    glNormalPointer(GL_FLOAT, stride, (void*)(sizeof(float) * 3));
+    if (mesh->texture) {
+        glEnableClientState(GL_TEXTURE_COORD_ARRAY);
+        glTexCoordPointer(2, GL_FLOAT, stride, (void*)(sizeof(float) * 6));
+    } else
+        glColor4f(1.f, 0.f, 1.f, 1.f);
+    glDrawElements(GL_TRIANGLES, mesh->sizeOfIndices, GL_UNSIGNED_INT, NULL);
+    if (mesh->texture)
+        glDisableClientState(GL_TEXTURE_COORD_ARRAY);
+    glDisableClientState(GL_NORMAL_ARRAY);
+    glDisableClientState(GL_VERTEX_ARRAY);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
     glPopMatrix();
     glDisable(GL_DEPTH_TEST);
     
@@ -93,5 +839,5 @@ static void RenderMesh(Mesh *mesh, int tx, int ty, Camera *camera) {
 
 void RenderModel(Model *model, int tx, int ty, Camera *camera) {
     for (int i = 0; i < model->sizeOfMeshes; i++)
-        RenderMesh(&model->meshes[0], tx, ty, camera);
+        RenderMesh(&model->meshes[i], tx, ty, camera);
 }
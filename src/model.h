@@ -10,20 +10,53 @@
 #include "common.h"
 
 typedef struct {
-    float *vertices;
+    uint32_t p, t, n;
+} ObjIndex;
+
+// OBJ attributes and faces as they are in the file. Index 0 of every
+// attribute is a default that corners without one point at, so the sizes
+// count it too.
+typedef struct {
+    float *positions, *texcoords, *normals;
+    uint32_t sizeOfPositions, sizeOfTexcoords, sizeOfNormals;
+    ObjIndex *indices;
+    uint32_t sizeOfIndices;
+    uint32_t *faces; // corners per face
+    uint32_t sizeOfFaces;
+} ObjData;
+
+typedef struct {
+    float *vertices; // position, normal, texcoord
     int sizeOfVertices;
+    uint32_t *indices; // triangles
+    int sizeOfIndices;
+    GLuint vbo, ibo; // 0 until uploaded
+    Vec3f min, max;
     Texture *texture;
 } Mesh;
 
 typedef struct {
     Mesh *meshes;
     int sizeOfMeshes;
+    // Set when the meshes point into a mapped cache file instead of the heap
+    void *mapping;
+    size_t sizeOfMapping;
     Vec3f position;
     Vec3f scale;
     Vec3f rotation;
 } Model;
 
+// Neither touches GL, so they can run on any thread. LoadModel goes
+// through a binary cache kept next to the OBJ (path + ".tbm"), rebuilt
+// whenever the OBJ's contents change.
+void LoadModel(const char *path, Model *out);
 void LoadModelObj(const char *path, Model *out);
+// Splits the file at line boundaries and parses the pieces on the job
+// system. Only v, vt, vn and f records are read.
+int ParseObj(const char *path, ObjData *out);
+void FreeObjData(ObjData *obj);
+// Moves every mesh into GL buffers, needs the context current
+void UploadModel(Model *model);
 void RenderModel(Model *model, int tx, int ty, Camera *camera);
 
 #endif /* model_h */
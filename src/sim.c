@@ -0,0 +1,96 @@
+//
+//  sim.c
+//  tbce
+//
+//  Created by George Watson on 17/10/2026.
+//
+
+#include "sim.h"
+
+static float WrapAngle(float angle) {
+    if (angle > TWO_PI)
+        return angle - TWO_PI;
+    else if (angle < 0)
+        return TWO_PI + angle;
+    return angle;
+}
+
+// Shortest way round from a to b
+static float AngleDelta(float a, float b) {
+    float diff = b - a;
+    if (fabsf(diff) > PI)
+        diff += (diff > 0 ? -2.f : 2.f) * PI;
+    return diff;
+}
+
+void InitSimulation(Simulation *sim, Camera *camera) {
+    sim->current.camera = *camera;
+    sim->previous = sim->current;
+    sim->accumulator = 0.0;
+}
+
+// Coming back from idle nothing is left half stepped, so easing starts from
+// rest instead of catching up on time nobody saw
+void ResumeSimulation(Simulation *sim) {
+    sim->previous = sim->current;
+    sim->accumulator = 0.0;
+}
+
+void StepSimulation(SimState *state, Camera *target, double dt) {
+    Camera *camera = &state->camera;
+    float t = (float)(10.0 * dt);
+    camera->position += (target->position - camera->position) * t;
+    float diff = AngleDelta(camera->angle, target->angle);
+    camera->angle = WrapAngle(camera->angle + diff * t);
+    camera->pitch += (target->pitch - camera->pitch) * t;
+    camera->zoom += (target->zoom - camera->zoom) * t;
+    // Snap once close enough, otherwise the easing never settles and the
+    // map has to be rebuilt every frame
+    if (fabsf(target->position.x - camera->position.x) < CAMERA_EPSILON &&
+        fabsf(target->position.y - camera->position.y) < CAMERA_EPSILON)
+        camera->position = target->position;
+    if (fabsf(diff) < CAMERA_EPSILON)
+        camera->angle = target->angle;
+    if (fabsf(target->pitch - camera->pitch) < CAMERA_EPSILON)
+        camera->pitch = target->pitch;
+    if (fabsf(target->zoom - camera->zoom) < CAMERA_EPSILON)
+        camera->zoom = target->zoom;
+}
+
+int AdvanceSimulation(Simulation *sim, Camera *target, double elapsed) {
+    sim->accumulator += elapsed;
+    int steps = 0;
+    while (sim->accumulator >= SIM_TIMESTEP && steps < SIM_MAX_STEPS) {
+        sim->previous = sim->current;
+        StepSimulation(&sim->current, target, SIM_TIMESTEP);
+        sim->accumulator -= SIM_TIMESTEP;
+        steps++;
+    }
+    if (steps == SIM_MAX_STEPS)
+        sim->accumulator = MIN(sim->accumulator, SIM_TIMESTEP);
+    return steps;
+}
+
+// Renders land between steps, so draw the state that far between the last two
+void InterpolateSimulation(Simulation *sim, Camera *out) {
+    float alpha = (float)(sim->accumulator / SIM_TIMESTEP);
+    Camera *a = &sim->previous.camera;
+    Camera *b = &sim->current.camera;
+    out->position = a->position + (b->position - a->position) * alpha;
+    out->angle = WrapAngle(a->angle + AngleDelta(a->angle, b->angle) * alpha);
+    out->pitch = a->pitch + (b->pitch - a->pitch) * alpha;
+    out->zoom = a->zoom + (b->zoom - a->zoom) * alpha;
+}
+
+static int CameraEquals(Camera *a, Camera *b) {
+    return a->position.x == b->position.x &&
+           a->position.y == b->position.y &&
+           a->angle == b->angle &&
+           a->pitch == b->pitch &&
+           a->zoom == b->zoom;
+}
+
+int SimulationSettled(Simulation *sim, Camera *target) {
+    return CameraEquals(&sim->current.camera, target) &&
+           CameraEquals(&sim->previous.camera, target);
+}
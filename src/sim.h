@@ -0,0 +1,33 @@
+//
+//  sim.h
+//  tbce
+//
+//  Created by George Watson on 17/10/2026.
+//
+
+#ifndef sim_h
+#define sim_h
+#include "common.h"
+
+#define SIM_TIMESTEP (1.0 / 60.0)
+// Most steps taken in one frame, past this the simulation falls behind
+// instead of spiralling
+#define SIM_MAX_STEPS 8
+
+typedef struct {
+    Camera camera;
+} SimState;
+
+typedef struct {
+    SimState previous, current;
+    double accumulator;
+} Simulation;
+
+void InitSimulation(Simulation *sim, Camera *camera);
+void ResumeSimulation(Simulation *sim);
+void StepSimulation(SimState *state, Camera *target, double dt);
+int AdvanceSimulation(Simulation *sim, Camera *target, double elapsed);
+void InterpolateSimulation(Simulation *sim, Camera *out);
+int SimulationSettled(Simulation *sim, Camera *target);
+
+#endif /* sim_h */